@@ -1,10 +1,13 @@
 #include <unistd.h>
 
+#ifndef PEERSTER_DAEMON
 #include <QVBoxLayout>
 #include <QApplication>
+#include <QSizePolicy>
+#endif
+#include <QCoreApplication>
 #include <QDebug>
 #include <QChar>
-#include <QSizePolicy>
 #include <QVariantMap>
 #include <QHostAddress>
 #include <QIODevice>
@@ -12,9 +15,27 @@
 #include <QtCrypto>
 #include <QFile>
 #include <QRegExp>
+#include <QFileInfo>
+#include <QDir>
+#include <QThread>
+#include <QtConcurrentRun>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <limits.h>
+#ifdef Q_OS_LINUX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#endif
+// The erasure code's SSSE3 kernel is compiled for that instruction set
+// alone and only called once the CPU is found to have it
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || \
+    __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_SSSE3_KERNEL
+#include <tmmintrin.h>
+#endif
 #include "main.hh"
 
 // Message field identifiers
@@ -42,6 +63,85 @@ const QString BROADCAST = QString("Broadcast");
 const QString REPLACEMENT = QString("Replacement");
 const QString ONEBEHIND = QString("OneBehind");
 const QString REDUNDANT = QString("Redundant");
+const QString HOLDERS = QString("Holders");
+const QString CODEC = QString("Codec");
+const QString TYPE = QString("Type");
+const QString VNODES = QString("VNodes");
+const QString FRAGMENT = QString("Fragment");
+const QString FRAGMENTS = QString("Fragments");
+const QString ERASURE = QString("Erasure");
+const QString FILESIZE = QString("FileSize");
+const QString NEXTNODE = QString("NextNode");
+const QString STANDIN = QString("StandIn");
+// Fragment i of file F is kept as F.frag<i>
+const QString FRAGSUFFIX = QString(".frag");
+// The store index of the node on port p is kept as index_<p>
+const QString INDEXPREFIX = QString("index_");
+// Segment n of the chunk store of the node on port p is chunks_<p>.<n>
+const QString CHUNKPREFIX = QString("chunks_");
+// Eviction policy of the DHT store unless -evict= says otherwise
+const QString DEFEVICTION = QString("lru");
+
+// Binary tags for the field identifiers above, indexed by tag. Tag 0
+// marks a field whose name is sent in full. Append only: peers decode
+// by position.
+const QString WIRETAGS[] = {
+  QString(), CHATTEXT, SEQNO, WANT, ORIGIN, DEST, HOPLIMIT, LASTIP,
+  LASTPORT, BLOCKREQ, BLOCKREPLY, DATA, SEARCH, BUDGET, SEARCHREP,
+  MATCHNAMES, MATCHIDS, JOINDHT, FILENAME, FILEHASH, BLOCKLISTHASH,
+  BROADCAST, REPLACEMENT, ONEBEHIND, REDUNDANT, HOLDERS, CODEC, VNODES,
+  FRAGMENT, FRAGMENTS, ERASURE, FILESIZE, NEXTNODE, STANDIN
+};
+const int NWIRETAGS = sizeof(WIRETAGS) / sizeof(WIRETAGS[0]);
+// First byte of a binary datagram; a legacy QDataStream map starts with
+// the high byte of its size, which is 0 in practice
+const quint8 WIREMAGIC = 0xB5;
+// Datagrams taken from the socket per batched read
+const int RECVBATCH = 32;
+// Datagrams handed to the socket per batched write
+const int SENDBATCH = 64;
+// Largest datagram a batched read accepts
+const int MAXDATAGRAM = 65536;
+// Fewest blocks worth handing to a worker thread when ingesting a file
+const qint64 INGESTMINBLOCKS = 64;
+// Most ring positions FingerTable keeps memoized
+const int HASHCACHEMAX = 4096;
+// Size limit, in bytes, that earns a node one vnode
+const qint64 VNODEBYTES = 20 * 1024;
+// Most vnodes a node may host
+const int MAXVNODES = 64;
+// Redundant copies kept of each DHT file, on its owner's successors
+const int DEFREPLICAS = 2;
+// Most redundant copies a node may ask for
+const int MAXREPLICAS = 8;
+// Most fragments, data plus parity, a file may be erasure coded into
+const int MAXFRAGMENTS = 32;
+// Version of the binary format this peer speaks
+const quint8 WIREVERSION = 1;
+// Magic, version, message type, field count
+const int WIREHEADER = 4;
+// First byte of a store index
+const quint8 STOREMAGIC = 0xD5;
+// Version of the store index format this peer writes
+const quint8 STOREVERSION = 1;
+// Magic, version
+const int STOREHEADER = 2;
+// Records appended to the store index before it may be compacted
+const int INDEXCOMPACT = 4096;
+// Block SHA-1 and big-endian length ahead of each block in a segment
+const int CHUNKHEADER = 24;
+// Size past which the chunk store starts a new segment
+const qint64 SEGMENTBYTES = 64 * 1024 * 1024;
+// Live blocks copied out of a segment per compaction step
+const int COMPACTBATCH = 128;
+// Milliseconds between compaction steps
+const int COMPACTTICK = 200;
+// Binary value types
+enum WireValueType { WIRE_FALSE, WIRE_TRUE, WIRE_UINT, WIRE_INT,
+                     WIRE_ULONGLONG, WIRE_LONGLONG, WIRE_STRING,
+                     WIRE_BYTES, WIRE_LIST, WIRE_MAP };
+// How deeply lists and maps may nest in a binary message
+const int WIREMAXDEPTH = 4;
 
 // Default hop limit
 const quint32 DEFLIM = 10;
@@ -49,7 +149,100 @@ const quint32 DEFLIM = 10;
 const qint64 MAXBYTES = 8000;
 // Default budget
 const quint32 DEFBUDGET = 2;
+// Default number of block requests a download keeps in flight per source
+const int DEFWINDOW = 16;
+// Largest per-source window a download grows to
+const int MAXWINDOW = 64;
+// Consecutive timeouts after which a download source is failed over
+const int MAXTIMEOUTS = 3;
+// Milliseconds before an unanswered block request is resent
+const int RETRANSMIT = 2000;
+// Milliseconds between checks for block requests to resend
+const int RETRANSMITTICK = 500;
+// Milliseconds a leaving node waits for handoffs to be acknowledged
+// before offering them again
+const int LEAVERETRY = 2000;
+// Offers of its files a leaving node makes before leaving regardless
+const int LEAVERETRIES = 5;
+// Milliseconds between liveness probes of ring neighbours and fingers
+const int STABILIZETICK = 1000;
+// Milliseconds without a reply before a node is routed around
+const int SUSPECTTIMEOUT = 3000;
+// Milliseconds without a reply before a node is dropped from the ring
+const int DEADTIMEOUT = 8000;
+// Milliseconds a learned key owner is trusted for
+const qint64 OWNERCACHETTL = 60000;
+// Most key owners remembered
+const int OWNERCACHEMAX = 1024;
+// Queries an iterative lookup keeps in flight
+const int LOOKUPALPHA = 3;
+// Milliseconds an iterative lookup waits on one hop before asking
+// another node instead
+const qint64 LOOKUPTIMEOUT = 500;
+// Milliseconds between checks for lookup hops that timed out
+const int LOOKUPTICK = 100;
+// Searches relayed for a file within HOTWINDOW that make it worth caching
+const int HOTRELAYS = 3;
+// Milliseconds over which relayed searches are counted
+const qint64 HOTWINDOW = 10000;
+// Size limit, in bytes, of the cache of hot files, apart from dhtSizeLimit
+const qint64 HOTCACHEBYTES = 4 * 1024 * 1024;
+// Counters per row of the TinyLFU sketch, a power of two
+const int SKETCHWIDTH = 4096;
+// Rows of the TinyLFU sketch
+const int SKETCHDEPTH = 4;
+// Uses the TinyLFU sketch records before halving its counts
+const int SKETCHRESET = 10 * SKETCHWIDTH;
+// Most a TinyLFU sketch counter counts to
+const int SKETCHMAX = 15;
+// 2Q evicts from its FIFO while it holds more than 1/TWOQFIFOSHARE of
+// the stored files
+const int TWOQFIFOSHARE = 4;
+// Fewest evicted files 2Q remembers
+const int TWOQGHOSTMIN = 64;
+
+// Parse a size such as 512, 20k, 1.5M or 2GiB into bytes; suffixes
+// are powers of 1024
+static bool parseSize(QString text, qint64 *bytes) {
+  QString s = text.trimmed().toLower();
+  if (s.endsWith("b")) {
+    s.chop(1);
+  }
+  if (s.endsWith("i")) {
+    s.chop(1);
+  }
+  int shift = 0;
+  if (!s.isEmpty()) {
+    shift = QString("kmgt").indexOf(s.at(s.size() - 1)) + 1;
+  }
+  if (shift > 0) {
+    s.chop(1);
+  }
+  bool isNumeric = false;
+  double n = s.trimmed().toDouble(&isNumeric);
+  if (!isNumeric || n < 0) {
+    return false;
+  }
+  for (int i = 0; i < shift; i++) {
+    n *= 1024;
+  }
+  *bytes = (qint64) n;
+  return true;
+}
 
+// Format bytes for people, e.g. 1.5 MiB
+static QString formatSize(qint64 bytes) {
+  const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+  double n = bytes;
+  int unit = 0;
+  while (n >= 1024 && unit < 4) {
+    n /= 1024;
+    unit++;
+  }
+  return QString::number(n, 'g', 4) + " " + units[unit];
+}
+
+#ifndef PEERSTER_DAEMON
 // TEXTEDIT FUNCTIONS ------------------------------------------------
 
 TextEdit::TextEdit() {
@@ -86,8 +279,17 @@ ChatDialog::ChatDialog() {
   if (!sock->bind()) {
     exit(1);
   }
-  connect(sock, SIGNAL(readyRead()), this, SLOT(readMsg()));
-  sock->dhtSizeLimit = 20; 
+  connect(sock, SIGNAL(chatText(QString, QString)),
+          this, SLOT(displayText(QString, QString)));
+  connect(sock, SIGNAL(searchReply(QVariantMap)),
+          this, SLOT(processSearchRep(QVariantMap)));
+  // Node settings from the command line, taken as a daemon takes them
+  QStringList args = QCoreApplication::arguments();
+  for (int i = 1; i < args.size(); i++) {
+    if (args.at(i).startsWith(QChar('-'))) {
+      sock->applyOption(args.at(i));
+    }
+  }
   // Read-only text box where we display messages from everyone.
   // This widget expands both horizontally and vertically.
   textview = new QTextEdit(this);
@@ -109,11 +311,13 @@ ChatDialog::ChatDialog() {
   // List of known ports for starting private messages.
   pmLabel = new QLabel(this);
   pmLabel->setText("Start private message with");
-  sock->originList = new QComboBox(this);
-  connect(sock->originList, SIGNAL(activated(QString)),
-          sock, SLOT(resetOL()));
-  connect(sock->originList, SIGNAL(activated(QString)),
+  originList = new QComboBox(this);
+  connect(originList, SIGNAL(activated(QString)),
+          this, SLOT(resetOL()));
+  connect(originList, SIGNAL(activated(QString)),
           this, SLOT(newPrivateMsg(QString)));
+  connect(sock, SIGNAL(newOrigin(QString)),
+          this, SLOT(gotNewOrigin(QString)));
 
   // Button to share a file with a peer
   fileShare = new QPushButton(QString("Share File..."), this);
@@ -160,14 +364,14 @@ ChatDialog::ChatDialog() {
   connect(sock, SIGNAL(leftDHT()), this, SLOT(gotLeftDHT()));
   joinDHTBox = new QCheckBox(QString("Join DHT When Available"), this);
   connect(joinDHTBox, SIGNAL(stateChanged(int)),
-          sock, SLOT(gotChangedDHTPreference(int)));
+          this, SLOT(gotJoinDHTToggled(int)));
   connect(sock, SIGNAL(joinedDHT()), this, SLOT(gotJoinedDHT()));
 
   // sizeLimitBtn 
   sizeLimit = new QLineEdit(this);
-  sizeLimit->setPlaceholderText(QString("20"));
+  sizeLimit->setPlaceholderText(QString("20k"));
   sizeLimitLabel = new QLabel(this); 
-  sizeLimitLabel->setText("kB for DHT"); 
+  sizeLimitLabel->setText("for DHT"); 
 
   // Lay out the widgets to appear in the main window.
   QVBoxLayout *layout = new QVBoxLayout();
@@ -175,7 +379,7 @@ ChatDialog::ChatDialog() {
   layout->addWidget(textview);
   layout->addWidget(textline);
   layout->addWidget(pmLabel);
-  layout->addWidget(sock->originList);
+  layout->addWidget(originList);
   layout->addWidget(fileShare);
   layout->addWidget(downloadLabel);
   QHBoxLayout *download = new QHBoxLayout();
@@ -204,7 +408,7 @@ ChatDialog::ChatDialog() {
   textview->hide();
   textline->hide();
   pmLabel->hide();
-  sock->originList->hide();
+  originList->hide();
 
   setLayout(layout);
 
@@ -220,6 +424,7 @@ void ChatDialog::gotReturnPressed() {
   QString text = textline->toPlainText();
 
   QVariantMap *msg = new QVariantMap();
+  msg->insert(TYPE, MSG_RUMOR);
   msg->insert(CHATTEXT, QVariant(text));
   msg->insert(ORIGIN, sock->getOriginID());
   msg->insert(SEQNO, sock->getSeqNo());
@@ -257,12 +462,7 @@ void ChatDialog::gotDownloadReq() {
   targetNode->clear();
   hexBlock->clear();
 
-
-  if (sock->isDownloading()) {
-    qDebug() << " > request denied: other download in progress";
-  } else {
-    emit reqToDownload(fullPair, true);
-  }
+  emit reqToDownload(fullPair, true);
 }
 
 void ChatDialog::gotDownloadReqFromSearch(QListWidgetItem *item) {
@@ -303,14 +503,7 @@ void ChatDialog::gotJoinedDHT() {
   dhtLabel->setText("Status: Joined DHT");
   qDebug() << ">>>>>>>>>>>>> joined DHT";
   joinDHTBox->hide();
-  QString strLimit = sizeLimit->text().trimmed(); 
-  bool isNumeric = false; 
-  int foundLimit = strLimit.toInt(&isNumeric, 10); 
-  if (isNumeric) {
-    int factor = foundLimit/20;
-    sock->dhtSizeLimit = factor*20; 
-  } 
-  QString newLimitLabel = QString::number(sock->dhtSizeLimit) +
+  QString newLimitLabel = formatSize(sock->dhtSizeLimit) + " " +
     sizeLimitLabel->text(); 
   sizeLimitLabel->setText(newLimitLabel);  
   sizeLimit->hide(); 
@@ -318,11 +511,23 @@ void ChatDialog::gotJoinedDHT() {
 }
 
 
+void ChatDialog::gotJoinDHTToggled(int state) {
+  if (state == Qt::Checked) {
+    // The size limit decides how many vnodes to announce, so apply it
+    // before joining
+    qint64 foundLimit;
+    if (parseSize(sizeLimit->text(), &foundLimit)) {
+      sock->setDHTSizeLimit(foundLimit);
+    } 
+  }
+  sock->gotChangedDHTPreference(state);
+}
+
 void ChatDialog::gotLeaveDHT() {
   dhtLabel->setText("Status: Leaving DHT, transferring files");
   qDebug() << ">>>>>>>>>>>>> leaving DHT, transferring files";
   joinDHTBox->setCheckState(Qt::Unchecked);
-  sizeLimitLabel->setText("kB for DHT");  
+  sizeLimitLabel->setText("for DHT");  
   sizeLimit->show(); 
   leaveDHT->hide();
 }
@@ -352,197 +557,13 @@ void ChatDialog::displayText(QString sender, QString text) {
   textview->append(sender.append(QString(":\n > ")).append(text));
 }
 
-void ChatDialog::readMsg() {
-  while (sock->hasPendingDatagrams()) {
-    // Read incoming datagram
-    QByteArray datagram;
-    datagram.resize(sock->pendingDatagramSize());
-    QHostAddress sender;
-    quint16 senderPort;
-
-    sock->readDatagram(datagram.data(), datagram.size(),
-                       &sender, &senderPort);
-
-    // Learn new peers
-    sock->learnPeer(sender, senderPort);
-
-    Peer *senderPeer = new Peer(sender, senderPort);
-
-    QVariantMap msg;    
-    QDataStream s(&datagram, QIODevice::ReadOnly);
-    s >> msg;
-
-    // Triage based on datagram type
-    if (sock->isTransferRequest(msg)) {
-      qDebug() << "<<<<<<<<<<<<< got transfer request message for file"
-               << msg[FILENAME].toString();
-      sock->doTransferRequest(msg);
-    } else if (sock->isP2P(msg)) {
-      QString msgDest = msg.value(DEST).toString();
-      quint32 hopLim = msg.value(HOPLIMIT).toUInt();
-
-      if (msgDest == sock->getOriginID()) {
-        // This peerster is the destination
-
-        if (msg.find(CHATTEXT) != msg.end()) {
-          // Display PM
-          displayText(msg.value(ORIGIN).toString().
-                      append(QString(" (PM)")),
-                      msg.value(CHATTEXT).toString());
-        } else if (msg.find(BLOCKREQ) != msg.end()) {
-          // A BlockRequest can be the hash of either a data block
-          // or a blocklist metafile
-          QByteArray blockReq = msg.value(BLOCKREQ).toByteArray();
-          /*
-            qDebug() << "received block request from" <<
-            msg.value(ORIGIN).toString() << "asking for"
-            << blockReq.toHex();
-          */
-          // Find block or blocklist metadata
-          // from internal database
-          QByteArray foundBlock = sock->findBlock(blockReq);
-          if (!(foundBlock.isEmpty())) {
-            // Send reply
-            QVariantMap *rep = new QVariantMap();
-            rep->insert(ORIGIN, sock->getOriginID());
-            rep->insert(DEST, msg.value(ORIGIN).toString());
-            rep->insert(BLOCKREPLY, blockReq);
-            rep->insert(DATA, foundBlock);
-            rep->insert(HOPLIMIT, DEFLIM);
-
-            sock->sendMsg(rep, *senderPeer);
-          } else {
-            // qDebug() << "did not send reply";
-          }
-        } else if (msg.find(BLOCKREPLY) != msg.end()) {
-          QByteArray blockReply = msg.value(BLOCKREPLY).
-            toByteArray();
-          QByteArray data = msg.value(DATA).toByteArray();
-          /*
-            qDebug() << sock->getOriginID() <<
-            "received block reply from" <<
-            msg.value(ORIGIN).toString() << "asking for"
-            << blockReply.toHex();
-          */
-          // Check that this data is expected
-          if (blockReply != sock->getDfileBlockReq() ||
-              msg.value(ORIGIN).toString() !=
-              sock->getTargetNode()) {
-            // qDebug() << "received unrequested reply"; // DEBUG
-          } else {
-            // Check that hash of data == blockReply
-            QCA::init();
-            if (!QCA::isSupported("sha1")) {
-              qDebug() << "error: SHA-1 not supported";
-              return;
-            }
-            QCA::Hash shaHash("sha1");
-            shaHash.update(data);
-            if (shaHash.final().toByteArray() == blockReply) {
-              sock->processBlockReply(data);
-            } else {
-              // Discard message where hashes don't agree
-              qDebug() << "error:" <<  sock->getOriginID()
-                       << "hashes not equal";
-              qDebug() << " > requestedBlock = " << blockReply.toHex()
-                       << " and data when hashed = "
-                       << shaHash.final().toByteArray().toHex();
-            }
-          }
-        } else {
-          processSearchRep(msg);
-        }
-      } else if (!sock->getNF() && hopLim > 1) {
-        // Forward if a forwarding peer
-        sock->forwardP2P(msg);
-      }
-      // NOTE: Discards msg that has reached the end of its hop limit
-    } else if (sock->isSearchReq(msg)) {
-      // Search for string and send search reply if matches found
-      QString filename = msg[SEARCH].toString(); 
-      int fileHash = sock->fingerTable->getHash(sock->nSpots, filename); 
-      qDebug() << "<<<<<<<<<<<<< received search for filename"
-               << filename << "with hash" << fileHash; 
-
-      if (sock->isMyDHTRequest(fileHash) ||
-          sock->haveRedundantCopy(filename)) {
-        qDebug() << sock->getOriginID() << "the search is for me"; 
-        sock->processSearchReq(msg, *senderPeer); 
-      } else {
-        sock->sendThroughFingerTable(&msg, fileHash); 
-        qDebug() << sock->getOriginID()
-                 << "passing search through finger table";
-      }
-    } else if (sock->isMsgOrRouteOrDHT(msg, senderPeer)) {
-      // Datagram is a message or route rumor
-
-      // Display message
-      if (msg.find(CHATTEXT) != msg.end()) {
-        displayText(msg.value(ORIGIN).toString(),
-                    msg.value(CHATTEXT).toString());
-      }
-			
-      // Process msg/route
-      processMsgOrRouteOrDHT(msg, senderPeer);
-    } else if (msg.find(WANT) != msg.end()) {
-      // Datagram is a status
-      sock->processStatus(msg, *senderPeer);
-    } else {
-      // Missing datagram fields or unwanted SeqNo
-      sock->sendStatus(senderPeer);
-    }
-  }
+void ChatDialog::gotNewOrigin(QString origin) {
+  originList->addItem(origin);
+  originList->setCurrentIndex(-1);
 }
 
-void ChatDialog::processMsgOrRouteOrDHT(QVariantMap msg, Peer *senderPeer) {
-  // Add to routingTable
-  sock->addToRT(msg.value(ORIGIN).toString(), senderPeer);
-
-  if (msg.find(JOINDHT) == msg.end()) {
-    // If chat msg or route rumor
-
-    // Archive message, update status
-    sock->processMsg(&msg);
-	
-    // Add last public IP address to peerList
-    QHostAddress h;
-    if (msg.find(LASTIP) != msg.end() && 
-        msg.find(LASTPORT) != msg.end()) {
-      h = QHostAddress(msg[LASTIP].toUInt());
-      sock->learnPeer(h, msg[LASTPORT].toUInt());
-    }
-		
-    // Set last public IP address
-    msg.remove(LASTIP);
-    msg.remove(LASTPORT);
-    quint32 ip = senderPeer->host.toIPv4Address();
-    msg.insert(LASTIP, ip);
-    msg.insert(LASTPORT, senderPeer->port);
-
-    // Send back status
-    sock->sendStatus(senderPeer);
-  } else {
-    // Process join DHT request
-
-    // Update dhtStatus
-    sock->updateDhtStatus(&msg);
-
-    if (msg.value(JOINDHT).toBool()) {
-      // If senderPeer wants to join DHT, process
-      sock->processJoinReq(msg, senderPeer);
-    } else {
-      // If wants to leave DHT, update finger table
-      sock->processLeaveReq(msg);
-    }
-  }
-
-  // Monger msg, or broadcast route rumor or dht join request
-  if (msg.find(CHATTEXT) != msg.end()) {
-    sock->monger(&msg, sock->pickPeer(*senderPeer));
-  } else {
-    msg.insert(BROADCAST, true);
-    sock->broadcast(&msg, senderPeer);
-  }
+void ChatDialog::resetOL() {
+  originList->setCurrentIndex(-1);
 }
 
 void ChatDialog::newPrivateMsg(QString origin) {
@@ -558,12 +579,13 @@ void ChatDialog::newPrivateMsg(QString origin) {
 }
 
 void ChatDialog::shareFile() {
+  QFileDialog *dialog = new QFileDialog();
+  dialog->setFileMode(QFileDialog::ExistingFiles);
   FileSharing *share = new FileSharing();
-  share->setFileMode(QFileDialog::ExistingFiles);
 
-  share->show();
+  dialog->show();
 
-  connect(share, SIGNAL(filesSelected(QStringList)), share,
+  connect(dialog, SIGNAL(filesSelected(QStringList)), share,
           SLOT(gotFilesSelected(QStringList)));
   connect(share, SIGNAL(shareFiles(FileSharing*)),
           sock, SLOT(gotShareFiles(FileSharing*)));
@@ -592,20 +614,80 @@ void ChatDialog::processSearchRep(QVariantMap msg) {
   }
   // NOTE: discards message that is not reply to current search
 }
+#endif
 
 
 // FILES FUNCTIONS ------------------------------------------------
 
 Files::Files() {
+  filesize = 0;
+  packed = false;
+}
+
+// BLOCKLOCATION FUNCTIONS ------------------------------------------------
+
+BlockLocation::BlockLocation() {
+  archive = DHT_ARCHIVE;
+  blockIndex = -1;
+}
+
+BlockLocation::BlockLocation(int a, QString f, qint64 b) {
+  archive = a;
+  filename = f;
+  blockIndex = b;
+}
+
+bool BlockLocation::operator==(const BlockLocation l) const {
+  return archive == l.archive && filename == l.filename &&
+    blockIndex == l.blockIndex;
 }
 
 // DFILE FUNCTIONS ------------------------------------------------
 
 DownloadFile::DownloadFile() {
+  file = NULL;
+  writeFile = NULL;
+  blocksDownloaded = 0;
+  packed = false;
+  bytesReceived = 0;
+  msg = NULL;
+  outstanding = new QMap<qint64, QPair<qint64, int> >();
+  pending = new QList<qint64>();
+  blockPositions = new QHash<QByteArray, QList<qint64> >();
+  nextBlock = 0;
+  retransmit = NULL;
+}
+
+int DownloadFile::sourceIndex(QString origin) {
+  for (int i = 0; i < sources.size(); i++) {
+    if (sources.at(i).originID == origin) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+DownloadSource::DownloadSource() {
+  inFlight = 0;
+  window = DEFWINDOW;
+  srtt = -1;
+  timeouts = 0;
+  failed = false;
+}
+
+DownloadSource::DownloadSource(QString o, Peer p) {
+  originID = o;
+  peer = p;
+  inFlight = 0;
+  window = DEFWINDOW;
+  srtt = -1;
+  timeouts = 0;
+  failed = false;
 }
 
 // FILESHARING FUNCTIONS ------------------------------------------------
 FileSharing::FileSharing() {
+  pending = 0;
 }
 
 void FileSharing::gotFilesSelected(QStringList fileList) {
@@ -615,258 +697,1959 @@ void FileSharing::gotFilesSelected(QStringList fileList) {
     return;
   }
 
+  pending = fileList.size();
+  if (pending == 0) {
+    emit shareFiles(this);
+    return;
+  }
   QStringListIterator it(fileList);
   while (it.hasNext()) {
-    Files *file = getFile(it.next());
-    if (file == NULL) {
-      continue;
-    }
-    qDebug() << ">>>>>>>>>>>>> sharing file" << file->filename;
-    files.append(*file);
+    FileIngest *ingest = new FileIngest(it.next(), INGEST_SHARE,
+                                        QVariantMap());
+    connect(ingest, SIGNAL(finished(FileIngest*)),
+            this, SLOT(gotFileIngested(FileIngest*)));
+    ingest->start();
   }
-
-  emit shareFiles(this);
 }
 
-Files* FileSharing::getFile(QString fileName) {
-  Files *file = new Files();
+void FileSharing::gotFileIngested(FileIngest *ingest) {
+  if (ingest->ok) {
+    qDebug() << ">>>>>>>>>>>>> sharing file" << ingest->file.filename;
+    files.append(ingest->file);
+  }
+  ingest->deleteLater();
 
-  file->filename = fileName;
-  QFile qfile(file->filename);
-  if (!qfile.open(QIODevice::ReadOnly)) {
-    qDebug() << "error: could not open file" << file->filename;
-    return NULL;
+  // Share once every selected file is hashed
+  if (--pending == 0) {
+    emit shareFiles(this);
   }
+}
 
-  file->filesize = qfile.size();
+// FILEINGEST FUNCTIONS ------------------------------------------------
+
+// Hash nBlocks blocks of the file at path, starting at block first,
+// returning their concatenated SHA-1s or an empty array on error.
+// Runs on a worker thread.
+static QByteArray hashBlocks(QString path, qint64 first, qint64 nBlocks) {
+  QByteArray hashes;
+  QFile qfile(path);
+  if (!qfile.open(QIODevice::ReadOnly) || !qfile.seek(first*MAXBYTES)) {
+    return hashes;
+  }
 
-  // Compute hash for each block and append to blocklist
   QCA::Hash shaHash("sha1");
   QByteArray read;
-  while (!(read = qfile.read(MAXBYTES)).isEmpty()) {
+  for (qint64 i = 0; i < nBlocks; i++) {
+    read = qfile.read(MAXBYTES);
+    if (read.isEmpty()) {
+      return QByteArray();
+    }
     shaHash.update(read);
-    file->blocklist.append(shaHash.final().toByteArray());
+    hashes.append(shaHash.final().toByteArray());
     shaHash.clear();
   }
+  return hashes;
+}
 
-  // Take hash of blocklist
-  shaHash.update(file->blocklist);
-  file->blocklistHash = shaHash.final().toByteArray();
-  // qDebug() << " > hash of file: " << file->blocklistHash.toHex();
-
-  // Get relative file name
-  QStringList parts = file->filename.split("/");
-  file->filename = parts.last();
-  return file;
+FileIngest::FileIngest(QString p, int pur, QVariantMap ctx) {
+  path = p;
+  purpose = pur;
+  context = ctx;
+  ok = false;
+  remaining = 0;
 }
 
-// PRIVATEMESSAGE FUNCTIONS ------------------------------------------------
+void FileIngest::start() {
+  QFileInfo info(path);
+  if (!info.exists()) {
+    qDebug() << "error: could not open file" << path;
+    emit finished(this);
+    return;
+  }
 
-PrivateMessage::PrivateMessage() {
+  // Get relative file name
+  file.filename = info.fileName();
+  file.filesize = info.size();
+  qint64 nBlocks = (file.filesize + MAXBYTES - 1) / MAXBYTES;
+
+  // Split the blocks into one contiguous range per worker, unless the
+  // file is too small to be worth it
+  qint64 nRanges = (nBlocks + INGESTMINBLOCKS - 1) / INGESTMINBLOCKS;
+  if (nRanges > QThread::idealThreadCount()) {
+    nRanges = QThread::idealThreadCount();
+  }
+  if (nRanges < 1) {
+    nRanges = 1;
+  }
+  qint64 perRange = (nBlocks + nRanges - 1) / nRanges;
+
+  for (qint64 first = 0; first < nBlocks || ranges.isEmpty();
+       first += perRange) {
+    qint64 n = qMin(perRange, nBlocks - first);
+    QFutureWatcher<QByteArray> *watcher = new QFutureWatcher<QByteArray>(this);
+    connect(watcher, SIGNAL(finished()), this, SLOT(gotRangeHashed()));
+    ranges.append(watcher);
+    watcher->setFuture(QtConcurrent::run(hashBlocks, path, first, n));
+  }
+  remaining = ranges.size();
 }
 
-PrivateMessage::PrivateMessage(QString d) {
-  msgText = new TextEdit();
-  destination = d;
-
-  QVBoxLayout *layout = new QVBoxLayout();
-  QLabel *label = new QLabel(this);
-  label->setText(QString("Private message with ").append(destination));
-	
-  layout->addWidget(label);
-  layout->addWidget(msgText);
+void FileIngest::gotRangeHashed() {
+  if (--remaining > 0) {
+    return;
+  }
 
-  setLayout(layout);
+  // Stitch the ranges back together in file order
+  ok = true;
+  for (int i = 0; i < ranges.size(); i++) {
+    QByteArray hashes = ranges.at(i)->result();
+    if (hashes.isEmpty() && file.filesize > 0) {
+      qDebug() << "error: could not read file" << path;
+      ok = false;
+    }
+    file.blocklist.append(hashes);
+    ranges.at(i)->deleteLater();
+  }
+  ranges.clear();
 
-  // Send message upon return press
-  connect(msgText, SIGNAL(returnPressed()), this, SLOT(gotReturn()));
-  // Close window after sending message
-  connect(this, SIGNAL(closeWindow()), this, SLOT(close()));
+  // Take hash of blocklist
+  QCA::Hash shaHash("sha1");
+  shaHash.update(file.blocklist);
+  file.blocklistHash = shaHash.final().toByteArray();
+  emit finished(this);
 }
 
-void PrivateMessage::gotReturn() {
-  QVariantMap *msg = new QVariantMap();
-  msg->insert(DEST, destination);
-  msg->insert(CHATTEXT, msgText->toPlainText());
-  msg->insert(HOPLIMIT, DEFLIM);
-  emit sendPM(*msg);
-
-  // Close private message window
-  emit closeWindow();
+// ERASURECODE FUNCTIONS ------------------------------------------------
+
+quint8 ErasureCode::expTable[510];
+quint8 ErasureCode::logTable[256];
+bool ErasureCode::tablesReady = false;
+bool ErasureCode::useSsse3 = false;
+
+#ifdef HAVE_SSSE3_KERNEL
+// dst ^= c * src for the whole 16-byte runs of len, given the products
+// of c with every low nibble (lo) and high nibble (hi); returns the
+// bytes done
+__attribute__((target("ssse3")))
+static int mulAddSsse3(const uchar *lo, const uchar *hi, const uchar *src,
+                       uchar *dst, int len) {
+  __m128i loTable = _mm_loadu_si128((const __m128i *) lo);
+  __m128i hiTable = _mm_loadu_si128((const __m128i *) hi);
+  __m128i mask = _mm_set1_epi8(0x0f);
+  int i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i l = _mm_and_si128(v, mask);
+    __m128i h = _mm_and_si128(_mm_srli_epi64(v, 4), mask);
+    __m128i p = _mm_xor_si128(_mm_shuffle_epi8(loTable, l),
+                              _mm_shuffle_epi8(hiTable, h));
+    __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, p));
+  }
+  return i;
 }
-
-// PEER FUNCTIONS ------------------------------------------------
-Peer::Peer() {
+#endif
+
+void ErasureCode::initTables() {
+  // Powers of 2 modulo x^8 + x^4 + x^3 + x^2 + 1, written out twice so
+  // that adding two logs needs no reduction
+  int x = 1;
+  for (int i = 0; i < 255; i++) {
+    expTable[i] = (quint8) x;
+    expTable[i + 255] = (quint8) x;
+    logTable[x] = (quint8) i;
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= 0x11d;
+    }
+  }
+  logTable[0] = 0;
+#ifdef HAVE_SSSE3_KERNEL
+  useSsse3 = __builtin_cpu_supports("ssse3");
+#endif
+  tablesReady = true;
 }
 
-Peer::Peer(QHostAddress h, quint16 p) {
-  host = h;
-  port = p;
+ErasureCode::ErasureCode(int k, int m) {
+  dataCount = k;
+  parityCount = m;
+  if (!tablesReady) {
+    initTables();
+  }
 }
 
-bool Peer::isEqual(Peer p) {
-  return this->host == p.host && this->port == p.port;
+quint8 ErasureCode::mul(quint8 a, quint8 b) {
+  if (a == 0 || b == 0) {
+    return 0;
+  }
+  return expTable[logTable[a] + logTable[b]];
 }
 
-bool Peer::operator==(const Peer p) {
-  return this->isEqual(p);
+quint8 ErasureCode::inv(quint8 a) {
+  return expTable[255 - logTable[a]];
 }
 
-QString Peer::toString() {
-  return host.toString().append(QString(":")).append(QString::number(port));
+quint8 ErasureCode::coef(int i, int j) {
+  if (i < dataCount) {
+    return i == j ? 1 : 0;
+  }
+  // Cauchy entry 1/(x_i + y_j) with x_i = i and y_j = j, which never
+  // coincide as i >= k > j
+  return inv((quint8) (i ^ j));
 }
 
-// FINGER TABLE FUNCTIONS ---------------------------------------------
-FingerTable::FingerTable() {
-  oneBehind = "";
-  curHash = 0;
-};
-
-FingerTable::FingerTable(int nSpots, QString originID) {
-  curHash = getHash(nSpots, originID);
-  items = *(new QVector<FingerTableItem*>());
-  int fingerIndex = 1;
-  oneBehind = originID;
-  while (fingerIndex < nSpots) {
-    FingerTableItem *item = new FingerTableItem();
-    item->intervalStart = (fingerIndex + curHash)%nSpots;
-    fingerIndex *= 2;
-    item->intervalEnd = (fingerIndex + curHash)%nSpots;
-    item->originID = originID; 
-    items.push_back(item);
+void ErasureCode::mulAdd(quint8 c, const uchar *src, uchar *dst, int len) {
+  if (c == 0) {
+    return;
+  }
+  int i = 0;
+#ifdef HAVE_SSSE3_KERNEL
+  if (useSsse3) {
+    // Look up the products of both nibbles of 16 bytes at once
+    uchar lo[16], hi[16];
+    for (int n = 0; n < 16; n++) {
+      lo[n] = mul(c, (quint8) n);
+      hi[n] = mul(c, (quint8) (n << 4));
+    }
+    i = mulAddSsse3(lo, hi, src, dst, len);
+  }
+#endif
+  if (c == 1) {
+    for (; i < len; i++) {
+      dst[i] ^= src[i];
+    }
+    return;
+  }
+  int logC = logTable[c];
+  for (; i < len; i++) {
+    if (src[i] != 0) {
+      dst[i] ^= expTable[logC + logTable[src[i]]];
+    }
   }
 }
 
-void FingerTable::addNode(int nSpots, QString originID) {
-  int newHash = getHash(nSpots, originID); 
+QList<QByteArray> ErasureCode::encode(QList<QByteArray> data) {
+  QList<QByteArray> parity;
+  int len = data.isEmpty() ? 0 : data.at(0).size();
+  for (int p = 0; p < parityCount; p++) {
+    QByteArray out(len, '\0');
+    for (int j = 0; j < dataCount && j < data.size(); j++) {
+      mulAdd(coef(dataCount + p, j), (const uchar *) data.at(j).constData(),
+             (uchar *) out.data(), len);
+    }
+    parity.append(out);
+  }
+  return parity;
+}
 
-  // replace everything necessary 
-  for (int i = 0; i < items.size(); i++) {
-    FingerTableItem *curItem = items.at(i); 
-    int oldHash = getHash(nSpots, curItem->originID); 
-    int oldDistance = 0; 
-    int newDistance = 0; 
-		
-    // calculate the distance from the intervalStart
-    if (oldHash < curItem->intervalStart) {
-      oldDistance = nSpots - curItem->intervalStart + oldHash; 
-    } else {
-      oldDistance = oldHash - curItem->intervalStart; 
+QList<QByteArray> ErasureCode::decode(QMap<int, QByteArray> have) {
+  QList<QByteArray> data;
+  int k = dataCount;
+  if (have.size() < k) {
+    return data;
+  }
+  // Keys are sorted, so whatever data fragments arrived are used first
+  QList<int> rows = have.keys().mid(0, k);
+  int len = have.value(rows.at(0)).size();
+
+  // Invert the rows of the code matrix for those fragments by
+  // Gauss-Jordan elimination, turning b from the identity into the inverse
+  QVector<quint8> a(k*k), b(k*k);
+  for (int r = 0; r < k; r++) {
+    for (int j = 0; j < k; j++) {
+      a[r*k + j] = coef(rows.at(r), j);
+      b[r*k + j] = r == j ? 1 : 0;
     }
-    if (newHash < curItem->intervalStart) {
-      newDistance = nSpots - curItem->intervalStart + newHash; 
-    } else {
-      newDistance = newHash - curItem->intervalStart; 
+  }
+  for (int col = 0; col < k; col++) {
+    int pivot = col;
+    while (pivot < k && a[pivot*k + col] == 0) {
+      pivot++;
     }
-
-    // replace if necessary
-    if (newDistance < oldDistance) {
-      if (i == 0) {
-        // Delete items in redundancy archive if new node replaces node ahead
-        emit deleteRedundancies();
+    if (pivot == k) {
+      return data;
+    }
+    for (int j = 0; j < k; j++) {
+      quint8 t = a[col*k + j];
+      a[col*k + j] = a[pivot*k + j];
+      a[pivot*k + j] = t;
+      t = b[col*k + j];
+      b[col*k + j] = b[pivot*k + j];
+      b[pivot*k + j] = t;
+    }
+    quint8 f = inv(a[col*k + col]);
+    for (int j = 0; j < k; j++) {
+      a[col*k + j] = mul(a[col*k + j], f);
+      b[col*k + j] = mul(b[col*k + j], f);
+    }
+    for (int r = 0; r < k; r++) {
+      quint8 g = a[r*k + col];
+      if (r == col || g == 0) {
+        continue;
+      }
+      for (int j = 0; j < k; j++) {
+        a[r*k + j] ^= mul(g, a[col*k + j]);
+        b[r*k + j] ^= mul(g, b[col*k + j]);
       }
-      curItem->originID = originID; 
     }
   }
-  updateBehindHash(nSpots, originID);
-  qDebug() << " > added" << originID << "with hash =" << newHash;
-  printFingerTable();
-}
-
-void FingerTable::updateBehindHash(int nSpots, QString newID) {
-  int behindHash = getHash(nSpots, oneBehind);
-  int nodeHash = getHash(nSpots, newID);
-  int oldDistance = getDistance(nSpots, curHash, behindHash);
-  int newDistance = getDistance(nSpots, curHash, nodeHash);
 
-  if (newDistance < oldDistance) {
-    oneBehind = newID;
+  for (int j = 0; j < k; j++) {
+    // Data fragments that arrived need no arithmetic
+    if (have.contains(j)) {
+      data.append(have.value(j));
+      continue;
+    }
+    QByteArray out(len, '\0');
+    for (int t = 0; t < k; t++) {
+      mulAdd(b[j*k + t], (const uchar *) have.value(rows.at(t)).constData(),
+             (uchar *) out.data(), len);
+    }
+    data.append(out);
   }
+  return data;
 }
 
-int FingerTable::getDistance(int nSpots, int dest, int cur) {
-  if (cur < dest) {
-    return dest - cur;
-  } else {
-    return nSpots - cur + dest;
-  }
+// Stripes of k blocks needed for a file of the given size
+static qint64 stripeCount(qint64 size, int k) {
+  qint64 nBlocks = (size + MAXBYTES - 1) / MAXBYTES;
+  return qMax((qint64) 1, (nBlocks + k - 1) / k);
 }
 
-QString FingerTable::getPeerFromHash(int hash) {
-
-  for (int i = 0; i < items.size(); i++) {
-    FingerTableItem *curItem = items.at(i);
-    int low = curItem->intervalStart;
-    int high = curItem->intervalEnd;
-
-    if (high < low) {
-      if (hash < high || hash >= low) {
-        return curItem->originID;
-      }
-    } else {
-      if (hash >= low && hash < high) {
-        return curItem->originID;
-      }
+// Split a file into k data fragments, fragment j holding block j of
+// every stripe, zero-padded to a whole number of stripes
+static QList<QByteArray> splitStripes(QByteArray data, int k) {
+  qint64 stripes = stripeCount(data.size(), k);
+  QList<QByteArray> frags;
+  for (int j = 0; j < k; j++) {
+    QByteArray frag;
+    for (qint64 s = 0; s < stripes; s++) {
+      frag.append(data.mid((s*k + j)*MAXBYTES, MAXBYTES));
     }
+    frag.append(QByteArray((int) (stripes*MAXBYTES - frag.size()), '\0'));
+    frags.append(frag);
   }
-
-  return "";
+  return frags;
 }
 
-void FingerTable::printFingerTable() {
-  qDebug() << " ----- Finger Table -----";
-  for (int i = 0; i < items.size(); i++) {
-    FingerTableItem* curItem = items.at(i); 
-    qDebug() << " START = " << curItem->intervalStart << "\tEND = "
-             << curItem->intervalEnd << "\tORIGINID = " << curItem->originID; 
+// Inverse of splitStripes, for a file of the given size
+static QByteArray joinStripes(QList<QByteArray> frags, qint64 size) {
+  QByteArray data;
+  qint64 stripes = stripeCount(size, frags.size());
+  for (qint64 s = 0; s < stripes; s++) {
+    for (int j = 0; j < frags.size(); j++) {
+      data.append(frags.at(j).mid(s*MAXBYTES, MAXBYTES));
+    }
   }
-  qDebug() << " ONE BEHIND = " << oneBehind;
-  qDebug() << " ------------------------";
+  data.truncate(size);
+  return data;
 }
 
-int FingerTable::getHash(int nSpots, QString originId) {
-  QCA::init(); 
-  QCA::Hash shaHash("sha1"); 
-  shaHash.update(originId.toUtf8()); 
-  QByteArray hashArray = shaHash.final().toByteArray(); 
-  QDataStream hashStream(&hashArray, QIODevice::ReadWrite); 
-  quint32 toReturn; 
-  hashStream >> toReturn;  
-  toReturn = toReturn%nSpots; 
-  return toReturn; 
+// Blocklist of data fragment j, out of the blocklist of the whole file
+static QByteArray fragmentBlocklist(QByteArray blocklist, int k, int j) {
+  QByteArray frag;
+  for (qint64 b = j; b < blocklist.size() / 20; b += k) {
+    frag.append(blocklist.mid(20*b, 20));
+  }
+  return frag;
 }
 
-// FINGER TALBE ITEM FUNCTIONS -----------------------------------------
-FingerTableItem::FingerTableItem() {
-  intervalStart = 0;
-  intervalEnd = 0;
-  originID = "";
+// Name fragment i of filename is kept under
+static QString fragmentName(QString filename, int i) {
+  return filename + FRAGSUFFIX + QString::number(i);
 }
 
-// NETSOCKET FUNCTIONS ------------------------------------------------
+// WIREMESSAGE FUNCTIONS ------------------------------------------------
 
-NetSocket::NetSocket() {
-  // Pick a range of four UDP ports to try to allocate by default,
-  // computed based on my Unix user ID.
-  // This makes it trivial for up to four Peerster instances per user
-  // to find each other on the same host,
-  // barring UDP port conflicts with other applications
-  // (which are quite possible).
-  // We use the range from 32768 to 49151 for this purpose.
-  myPortMin = 32768 + (getuid() % 4096)*4;
-  myPortMax = myPortMin + 3;
-  seqNo = 1;
-  dhtSeqNo = 1;
-  noForward = false;
-  nSpots = 32;
-  recentDHTFiles = new QVector<QString>(); 
-  dhtCurrentSize = 0; 
+static void putVarint(QByteArray &out, quint64 v) {
+  while (v >= 0x80) {
+    out.append((char) ((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+  out.append((char) v);
 }
 
+static bool getVarint(const char *data, int size, int &pos, quint64 &v) {
+  v = 0;
+  for (int shift = 0; shift < 64 && pos < size; shift += 7) {
+    quint8 b = (quint8) data[pos++];
+    v |= ((quint64) (b & 0x7f)) << shift;
+    if (!(b & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
 
+static void putBytes(QByteArray &out, QByteArray bytes) {
+  putVarint(out, bytes.size());
+  out.append(bytes);
+}
 
-bool NetSocket::bind() {
-  // Try to bind to each of the range myPortMin..myPortMax in turn.
+// Append the type and encoding of v, returning false if v has a type
+// the binary format does not carry
+static bool putValue(QByteArray &out, const QVariant &v) {
+  switch (v.type()) {
+  case QVariant::Bool:
+    out.append((char) (v.toBool() ? WIRE_TRUE : WIRE_FALSE));
+    return true;
+  case QVariant::UInt:
+    out.append((char) WIRE_UINT);
+    putVarint(out, v.toUInt());
+    return true;
+  case QVariant::ULongLong:
+    out.append((char) WIRE_ULONGLONG);
+    putVarint(out, v.toULongLong());
+    return true;
+  case QVariant::Int:
+  case QVariant::LongLong: {
+    // Zigzag so that small negative numbers stay short
+    qint64 n = v.toLongLong();
+    out.append((char) (v.type() == QVariant::Int ? WIRE_INT : WIRE_LONGLONG));
+    putVarint(out, ((quint64) n << 1) ^ (quint64) (n >> 63));
+    return true;
+  }
+  case QVariant::String:
+    out.append((char) WIRE_STRING);
+    putBytes(out, v.toString().toUtf8());
+    return true;
+  case QVariant::ByteArray:
+    out.append((char) WIRE_BYTES);
+    putBytes(out, v.toByteArray());
+    return true;
+  case QVariant::List:
+  case QVariant::StringList: {
+    QVariantList list = v.toList();
+    out.append((char) WIRE_LIST);
+    putVarint(out, list.size());
+    for (int i = 0; i < list.size(); i++) {
+      if (!putValue(out, list.at(i))) {
+        return false;
+      }
+    }
+    return true;
+  }
+  case QVariant::Map: {
+    QVariantMap map = v.toMap();
+    out.append((char) WIRE_MAP);
+    putVarint(out, map.size());
+    QMapIterator<QString, QVariant> it(map);
+    while (it.hasNext()) {
+      it.next();
+      putBytes(out, it.key().toUtf8());
+      if (!putValue(out, it.value())) {
+        return false;
+      }
+    }
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+// Step pos over a length-prefixed string or byte array
+static bool skipBytes(const char *data, int size, int &pos) {
+  quint64 len;
+  if (!getVarint(data, size, pos, len) || len > (quint64) (size - pos)) {
+    return false;
+  }
+  pos += len;
+  return true;
+}
+
+// Step pos over an encoded value of the given type, checking that it
+// lies within the datagram
+static bool skipValue(const char *data, int size, int &pos, quint8 type,
+                      int depth) {
+  quint64 n;
+  switch (type) {
+  case WIRE_FALSE:
+  case WIRE_TRUE:
+    return true;
+  case WIRE_UINT:
+  case WIRE_INT:
+  case WIRE_ULONGLONG:
+  case WIRE_LONGLONG:
+    return getVarint(data, size, pos, n);
+  case WIRE_STRING:
+  case WIRE_BYTES:
+    return skipBytes(data, size, pos);
+  case WIRE_LIST:
+  case WIRE_MAP:
+    if (depth >= WIREMAXDEPTH || !getVarint(data, size, pos, n)) {
+      return false;
+    }
+    for (quint64 i = 0; i < n; i++) {
+      if ((type == WIRE_MAP && !skipBytes(data, size, pos)) || pos >= size) {
+        return false;
+      }
+      quint8 t = (quint8) data[pos++];
+      if (!skipValue(data, size, pos, t, depth + 1)) {
+        return false;
+      }
+    }
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Read a length-prefixed string or byte array, already checked by skipBytes
+static QByteArray readBytes(const char *data, int &pos) {
+  quint64 len;
+  getVarint(data, pos + 10, pos, len);
+  QByteArray bytes(data + pos, len);
+  pos += len;
+  return bytes;
+}
+
+// Same, sharing the bytes with data instead of copying them
+static QByteArray viewBytes(const char *data, int &pos) {
+  quint64 len;
+  getVarint(data, pos + 10, pos, len);
+  QByteArray bytes = QByteArray::fromRawData(data + pos, len);
+  pos += len;
+  return bytes;
+}
+
+// Decode a value already checked by skipValue
+static QVariant readValue(const char *data, int &pos, quint8 type) {
+  quint64 n;
+  switch (type) {
+  case WIRE_FALSE:
+    return QVariant(false);
+  case WIRE_TRUE:
+    return QVariant(true);
+  case WIRE_UINT:
+    getVarint(data, pos + 10, pos, n);
+    return QVariant((uint) n);
+  case WIRE_ULONGLONG:
+    getVarint(data, pos + 10, pos, n);
+    return QVariant((quint64) n);
+  case WIRE_INT:
+  case WIRE_LONGLONG: {
+    getVarint(data, pos + 10, pos, n);
+    qint64 v = (qint64) (n >> 1) ^ -((qint64) (n & 1));
+    if (type == WIRE_INT) {
+      return QVariant((int) v);
+    }
+    return QVariant(v);
+  }
+  case WIRE_STRING: {
+    QByteArray utf8 = readBytes(data, pos);
+    return QVariant(QString::fromUtf8(utf8.constData(), utf8.size()));
+  }
+  case WIRE_BYTES:
+    return QVariant(readBytes(data, pos));
+  case WIRE_LIST: {
+    QVariantList list;
+    getVarint(data, pos + 10, pos, n);
+    for (quint64 i = 0; i < n; i++) {
+      quint8 t = (quint8) data[pos++];
+      list.append(readValue(data, pos, t));
+    }
+    return QVariant(list);
+  }
+  default: {
+    QVariantMap map;
+    getVarint(data, pos + 10, pos, n);
+    for (quint64 i = 0; i < n; i++) {
+      QByteArray key = readBytes(data, pos);
+      quint8 t = (quint8) data[pos++];
+      map.insert(QString::fromUtf8(key.constData(), key.size()),
+                 readValue(data, pos, t));
+    }
+    return QVariant(map);
+  }
+  }
+}
+
+WireMessage::WireMessage() {
+  version = 0;
+  type = 0;
+  nFields = 0;
+}
+
+QByteArray WireMessage::encode(QVariantMap msg) {
+  QByteArray out;
+  // The message type travels in the header rather than as a field
+  quint8 msgType = msg.value(TYPE).toUInt();
+  msg.remove(TYPE);
+  if (msg.size() > MAXFIELDS) {
+    return out;
+  }
+  out.append((char) WIREMAGIC);
+  out.append((char) WIREVERSION);
+  out.append((char) msgType);
+  out.append((char) msg.size());
+
+  QMapIterator<QString, QVariant> it(msg);
+  while (it.hasNext()) {
+    it.next();
+    int tag = 1;
+    while (tag < NWIRETAGS && WIRETAGS[tag] != it.key()) {
+      tag++;
+    }
+    if (tag < NWIRETAGS) {
+      out.append((char) tag);
+    } else {
+      out.append((char) 0);
+      putBytes(out, it.key().toUtf8());
+    }
+    if (!putValue(out, it.value())) {
+      return QByteArray();
+    }
+  }
+  return out;
+}
+
+bool WireMessage::parse(QByteArray datagram) {
+  raw = datagram;
+  const char *data = raw.constData();
+  int size = raw.size();
+  if (size < WIREHEADER || (quint8) data[0] != WIREMAGIC) {
+    return false;
+  }
+  version = (quint8) data[1];
+  type = (quint8) data[2];
+  nFields = (quint8) data[3];
+  if (version < 1 || version > WIREVERSION || nFields > MAXFIELDS) {
+    return false;
+  }
+
+  int pos = WIREHEADER;
+  for (int i = 0; i < nFields; i++) {
+    WireField &f = fields[i];
+    if (pos >= size) {
+      return false;
+    }
+    f.tag = (quint8) data[pos++];
+    if (f.tag >= NWIRETAGS) {
+      return false;
+    }
+    if (f.tag == 0) {
+      int start = pos;
+      if (!skipBytes(data, size, pos)) {
+        return false;
+      }
+      quint64 len;
+      getVarint(data, size, start, len);
+      f.nameOffset = start;
+      f.nameLength = len;
+    }
+    if (pos >= size) {
+      return false;
+    }
+    f.valueType = (quint8) data[pos++];
+    f.offset = pos;
+    if (!skipValue(data, size, pos, f.valueType, 0)) {
+      return false;
+    }
+    f.length = pos - f.offset;
+  }
+  return pos == size;
+}
+
+int WireMessage::find(QString name) {
+  for (int i = 0; i < nFields; i++) {
+    if (fields[i].tag != 0 && WIRETAGS[fields[i].tag] == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+QVariant WireMessage::value(int i) {
+  int pos = fields[i].offset;
+  return readValue(raw.constData(), pos, fields[i].valueType);
+}
+
+QByteArray WireMessage::bytes(QString name) {
+  int i = find(name);
+  if (i < 0 || (fields[i].valueType != WIRE_STRING &&
+                fields[i].valueType != WIRE_BYTES)) {
+    return QByteArray();
+  }
+  int pos = fields[i].offset;
+  return viewBytes(raw.constData(), pos);
+}
+
+QString WireMessage::string(QString name) {
+  int i = find(name);
+  if (i < 0 || fields[i].valueType != WIRE_STRING) {
+    return QString();
+  }
+  int pos = fields[i].offset;
+  quint64 len;
+  getVarint(raw.constData(), pos + 10, pos, len);
+  return QString::fromUtf8(raw.constData() + pos, len);
+}
+
+QStringList WireMessage::strings(QString name) {
+  int i = find(name);
+  if (i < 0 || fields[i].valueType != WIRE_LIST) {
+    return QStringList();
+  }
+  const char *data = raw.constData();
+  int pos = fields[i].offset;
+  quint64 n, len;
+  getVarint(data, pos + 10, pos, n);
+  QStringList list;
+  for (quint64 j = 0; j < n; j++) {
+    if ((quint8) data[pos++] != WIRE_STRING) {
+      return QStringList();
+    }
+    getVarint(data, pos + 10, pos, len);
+    list.append(QString::fromUtf8(data + pos, len));
+    pos += len;
+  }
+  return list;
+}
+
+QVariantMap WireMessage::toMap() {
+  QVariantMap msg;
+  for (int i = 0; i < nFields; i++) {
+    QString key = WIRETAGS[fields[i].tag];
+    if (fields[i].tag == 0) {
+      key = QString::fromUtf8(raw.constData() + fields[i].nameOffset,
+                              fields[i].nameLength);
+    }
+    msg.insert(key, value(i));
+  }
+  if (type != MSG_UNTYPED) {
+    msg.insert(TYPE, type);
+  }
+  return msg;
+}
+
+// STOREINDEX FUNCTIONS ------------------------------------------------
+
+StoreRecord::StoreRecord() {
+  op = STORE_PUT;
+  archive = DHT_ARCHIVE;
+  seqNo = 0;
+  dhtSeqNo = 0;
+}
+
+StoreRecord::StoreRecord(int o, int a, QString k, Files f) {
+  op = o;
+  archive = a;
+  key = k;
+  file = f;
+  seqNo = 0;
+  dhtSeqNo = 0;
+}
+
+StoreIndex::StoreIndex(QString p) {
+  path = p;
+  log = NULL;
+  appended = 0;
+}
+
+StoreIndex::~StoreIndex() {
+  delete log;
+}
+
+QList<StoreRecord> StoreIndex::load() {
+  QList<StoreRecord> records;
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly) || file.size() < STOREHEADER) {
+    return records;
+  }
+  uchar *map = file.map(0, file.size());
+  if (map == NULL) {
+    qDebug() << "error: could not map" << path;
+    return records;
+  }
+  const char *data = (const char *) map;
+  int size = file.size();
+  if ((quint8) data[0] != STOREMAGIC || (quint8) data[1] != STOREVERSION) {
+    qDebug() << "error:" << path << "is not a store index this peer reads";
+  } else {
+    int pos = STOREHEADER;
+    StoreRecord r;
+    while (pos < size && decode(data, size, pos, r)) {
+      records.append(r);
+    }
+    if (pos < size) {
+      qDebug() << " > ignoring a torn record at the end of" << path;
+    }
+  }
+  file.unmap(map);
+  return records;
+}
+
+bool StoreIndex::append(StoreRecord r) {
+  if (log == NULL) {
+    return false;
+  }
+  QByteArray record = encode(r);
+  if (log->write(record) != record.size()) {
+    qDebug() << "error: could not append to" << path;
+    return false;
+  }
+  log->flush();
+  appended++;
+  return true;
+}
+
+bool StoreIndex::rewrite(QList<StoreRecord> records) {
+  QByteArray data;
+  data.append((char) STOREMAGIC);
+  data.append((char) STOREVERSION);
+  for (int i = 0; i < records.size(); i++) {
+    data.append(encode(records.at(i)));
+  }
+
+  QString tmp = path + ".tmp";
+  QFile out(tmp);
+  if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+      out.write(data) != data.size()) {
+    qDebug() << "error: could not write" << tmp;
+    out.close();
+    QFile::remove(tmp);
+    return false;
+  }
+  out.close();
+  delete log;
+  log = NULL;
+  // Unlike QFile::rename, this replaces the old index in one step
+  if (::rename(tmp.toStdString().c_str(), path.toStdString().c_str()) != 0) {
+    qDebug() << "error: could not replace" << path;
+    return false;
+  }
+  log = new QFile(path);
+  if (!log->open(QIODevice::WriteOnly | QIODevice::Append)) {
+    qDebug() << "error: could not open" << path;
+    delete log;
+    log = NULL;
+    return false;
+  }
+  appended = 0;
+  return true;
+}
+
+QByteArray StoreIndex::encode(StoreRecord r) {
+  QByteArray body;
+  putVarint(body, r.op);
+  putVarint(body, r.archive);
+  putBytes(body, r.key.toUtf8());
+  if (r.op == STORE_PUT) {
+    putBytes(body, r.file.filename.toUtf8());
+    putBytes(body, r.file.blocklistHash);
+    putBytes(body, r.file.blocklist);
+    putVarint(body, r.file.filesize);
+    putVarint(body, r.file.packed ? 1 : 0);
+  } else if (r.op == STORE_ORIGIN) {
+    putVarint(body, r.seqNo);
+    putVarint(body, r.dhtSeqNo);
+  }
+
+  // Length and checksum, so a record cut short by a crash is noticed
+  QByteArray record;
+  putVarint(record, body.size());
+  quint16 sum = qChecksum(body.constData(), body.size());
+  record.append((char) (sum >> 8));
+  record.append((char) (sum & 0xff));
+  record.append(body);
+  return record;
+}
+
+bool StoreIndex::decode(const char *data, int size, int &pos,
+                        StoreRecord &r) {
+  quint64 len;
+  int at = pos;
+  if (!getVarint(data, size, at, len) || size - at < 2 ||
+      len > (quint64) (size - at - 2)) {
+    return false;
+  }
+  quint16 sum = ((quint8) data[at] << 8) | (quint8) data[at + 1];
+  const char *body = data + at + 2;
+  int end = len;
+  if (qChecksum(body, end) != sum) {
+    return false;
+  }
+
+  quint64 op, archive, filesize = 0, packed = 0;
+  int p = 0;
+  if (!getVarint(body, end, p, op) || !getVarint(body, end, p, archive)) {
+    return false;
+  }
+  // The key, then for STORE_PUT the file's name, blocklist hash and
+  // blocklist
+  QByteArray fields[4];
+  int nFields = op == STORE_PUT ? 4 : 1;
+  for (int i = 0; i < nFields; i++) {
+    int start = p;
+    if (!skipBytes(body, end, p)) {
+      return false;
+    }
+    fields[i] = readBytes(body, start);
+  }
+  if (op == STORE_PUT && (!getVarint(body, end, p, filesize) ||
+                          !getVarint(body, end, p, packed))) {
+    return false;
+  }
+  // Sequence numbers were added to origin records later
+  quint64 seq = 0, dhtSeq = 0;
+  if (op == STORE_ORIGIN && p < end &&
+      (!getVarint(body, end, p, seq) || !getVarint(body, end, p, dhtSeq))) {
+    return false;
+  }
+
+  r = StoreRecord();
+  r.op = op;
+  r.archive = archive;
+  r.key = QString::fromUtf8(fields[0].constData(), fields[0].size());
+  r.file.filename = QString::fromUtf8(fields[1].constData(), fields[1].size());
+  r.file.blocklistHash = fields[2];
+  r.file.blocklist = fields[3];
+  r.file.filesize = filesize;
+  r.file.packed = packed != 0;
+  r.seqNo = seq;
+  r.dhtSeqNo = dhtSeq;
+  pos = at + 2 + end;
+  return true;
+}
+
+// CHUNKSTORE FUNCTIONS ------------------------------------------------
+
+ChunkLocation::ChunkLocation() {
+  segment = -1;
+  offset = 0;
+  length = 0;
+  refs = 0;
+}
+
+ChunkStore::ChunkStore(QString p) {
+  prefix = p;
+  active = -1;
+}
+
+ChunkStore::~ChunkStore() {
+  QHashIterator<int, int> it(fds);
+  while (it.hasNext()) {
+    ::close(it.next().value());
+  }
+}
+
+void ChunkStore::open() {
+  QStringList names = QDir(".").entryList(QStringList(prefix + "*"));
+  for (int i = 0; i < names.size(); i++) {
+    bool isNumeric = false;
+    int segment = names.at(i).mid(prefix.size()).toInt(&isNumeric, 10);
+    if (!isNumeric) {
+      continue;
+    }
+    int fd = openSegment(segment);
+    if (fd < 0) {
+      continue;
+    }
+    active = qMax(active, segment);
+
+    // Walk the block headers, skipping over the data. Every block starts
+    // out dead, until the archives restored from the store index take it.
+    qint64 size = lseek(fd, 0, SEEK_END);
+    qint64 pos = 0;
+    char header[CHUNKHEADER];
+    while (pos + CHUNKHEADER <= size &&
+           pread(fd, header, CHUNKHEADER, pos) == CHUNKHEADER) {
+      int length = ((quint8) header[20] << 24) | ((quint8) header[21] << 16) |
+        ((quint8) header[22] << 8) | (quint8) header[23];
+      if (length < 0 || length > MAXBYTES ||
+          pos + CHUNKHEADER + length > size) {
+        break;
+      }
+      QByteArray hash(header, 20);
+      if (!chunks.contains(hash)) {
+        ChunkLocation loc;
+        loc.segment = segment;
+        loc.offset = pos + CHUNKHEADER;
+        loc.length = length;
+        chunks.insert(hash, loc);
+        segmentChunks[segment].insert(hash);
+      }
+      deadBytes[segment] += CHUNKHEADER + length;
+      pos += CHUNKHEADER + length;
+    }
+    if (pos < size) {
+      qDebug() << " > dropping a torn block at the end of" << names.at(i);
+      if (ftruncate(fd, pos) != 0) {
+        qDebug() << "error: could not truncate" << names.at(i);
+      }
+    }
+    segmentBytes[segment] = pos;
+  }
+}
+
+bool ChunkStore::contains(QByteArray hash) {
+  return chunks.contains(hash);
+}
+
+bool ChunkStore::containsAll(QByteArray blocklist) {
+  for (int i = 0; i + 20 <= blocklist.size(); i += 20) {
+    if (!chunks.contains(blocklist.mid(i, 20))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ChunkStore::write(QByteArray hash, QByteArray data) {
+  if (chunks.contains(hash)) {
+    return true;
+  }
+  return append(hash, data, 0);
+}
+
+QByteArray ChunkStore::read(QByteArray hash) {
+  if (!chunks.contains(hash)) {
+    return QByteArray();
+  }
+  ChunkLocation loc = chunks.value(hash);
+  QByteArray block(loc.length, 0);
+  if (pread(fds.value(loc.segment), block.data(), loc.length, loc.offset) !=
+      loc.length) {
+    qDebug() << "error reading from" << segmentName(loc.segment);
+    return QByteArray();
+  }
+  return block;
+}
+
+QByteArray ChunkStore::readFile(QByteArray blocklist) {
+  QByteArray data;
+  for (int i = 0; i + 20 <= blocklist.size(); i += 20) {
+    QByteArray hash = blocklist.mid(i, 20);
+    if (!chunks.contains(hash)) {
+      return QByteArray();
+    }
+    data.append(read(hash));
+  }
+  return data;
+}
+
+void ChunkStore::ref(QByteArray hash) {
+  if (!chunks.contains(hash)) {
+    return;
+  }
+  ChunkLocation &loc = chunks[hash];
+  if (loc.refs++ == 0) {
+    deadBytes[loc.segment] -= CHUNKHEADER + loc.length;
+  }
+}
+
+void ChunkStore::unref(QByteArray hash) {
+  if (!chunks.contains(hash) || chunks.value(hash).refs == 0) {
+    return;
+  }
+  ChunkLocation &loc = chunks[hash];
+  if (--loc.refs == 0) {
+    deadBytes[loc.segment] += CHUNKHEADER + loc.length;
+  }
+}
+
+void ChunkStore::refAll(QByteArray blocklist) {
+  for (int i = 0; i + 20 <= blocklist.size(); i += 20) {
+    ref(blocklist.mid(i, 20));
+  }
+}
+
+void ChunkStore::unrefAll(QByteArray blocklist) {
+  for (int i = 0; i + 20 <= blocklist.size(); i += 20) {
+    unref(blocklist.mid(i, 20));
+  }
+}
+
+bool ChunkStore::compactStep() {
+  // The segment with the most dead share, once past half
+  int victim = -1;
+  double worst = 0.5;
+  QHashIterator<int, qint64> it(segmentBytes);
+  while (it.hasNext()) {
+    it.next();
+    if (it.key() == active || it.value() == 0) {
+      continue;
+    }
+    double share = (double) deadBytes.value(it.key()) / it.value();
+    if (share > worst) {
+      worst = share;
+      victim = it.key();
+    }
+  }
+  if (victim < 0) {
+    return false;
+  }
+
+  // Live blocks move to the active segment; dead ones go with the victim
+  int moved = 0;
+  QSetIterator<QByteArray> hit(segmentChunks.value(victim));
+  while (hit.hasNext() && moved < COMPACTBATCH) {
+    QByteArray hash = hit.next();
+    ChunkLocation loc = chunks.value(hash);
+    if (loc.refs > 0) {
+      QByteArray data = read(hash);
+      chunks.remove(hash);
+      if (data.size() != loc.length || !append(hash, data, loc.refs)) {
+        chunks.insert(hash, loc);
+        return false;
+      }
+      deadBytes[victim] += CHUNKHEADER + loc.length;
+      moved++;
+    } else {
+      chunks.remove(hash);
+    }
+    segmentChunks[victim].remove(hash);
+  }
+  if (!segmentChunks.value(victim).isEmpty()) {
+    return true;
+  }
+
+  ::close(fds.take(victim));
+  remove(segmentName(victim).toStdString().c_str());
+  segmentBytes.remove(victim);
+  deadBytes.remove(victim);
+  segmentChunks.remove(victim);
+  qDebug() << " > compacted away" << segmentName(victim);
+  return true;
+}
+
+bool ChunkStore::append(QByteArray hash, QByteArray data, int refs) {
+  if (active < 0 ||
+      segmentBytes.value(active) + CHUNKHEADER + data.size() > SEGMENTBYTES) {
+    if (!roll()) {
+      return false;
+    }
+  }
+  QByteArray record = hash;
+  record.append((char) (data.size() >> 24));
+  record.append((char) (data.size() >> 16));
+  record.append((char) (data.size() >> 8));
+  record.append((char) data.size());
+  record.append(data);
+  qint64 offset = segmentBytes.value(active);
+  if (pwrite(fds.value(active), record.constData(), record.size(), offset) !=
+      record.size()) {
+    qDebug() << "error: could not write to" << segmentName(active);
+    return false;
+  }
+
+  ChunkLocation loc;
+  loc.segment = active;
+  loc.offset = offset + CHUNKHEADER;
+  loc.length = data.size();
+  loc.refs = refs;
+  chunks.insert(hash, loc);
+  segmentChunks[active].insert(hash);
+  segmentBytes[active] += record.size();
+  if (refs == 0) {
+    deadBytes[active] += record.size();
+  }
+  return true;
+}
+
+QString ChunkStore::segmentName(int segment) {
+  return prefix + QString::number(segment);
+}
+
+int ChunkStore::openSegment(int segment) {
+  int fd = ::open(segmentName(segment).toStdString().c_str(),
+                  O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    qDebug() << "error: could not open" << segmentName(segment);
+    return fd;
+  }
+  fds.insert(segment, fd);
+  return fd;
+}
+
+bool ChunkStore::roll() {
+  if (openSegment(active + 1) < 0) {
+    return false;
+  }
+  active++;
+  segmentBytes[active] = 0;
+  return true;
+}
+
+#ifndef PEERSTER_DAEMON
+// PRIVATEMESSAGE FUNCTIONS ------------------------------------------------
+
+PrivateMessage::PrivateMessage() {
+}
+
+PrivateMessage::PrivateMessage(QString d) {
+  msgText = new TextEdit();
+  destination = d;
+
+  QVBoxLayout *layout = new QVBoxLayout();
+  QLabel *label = new QLabel(this);
+  label->setText(QString("Private message with ").append(destination));
+	
+  layout->addWidget(label);
+  layout->addWidget(msgText);
+
+  setLayout(layout);
+
+  // Send message upon return press
+  connect(msgText, SIGNAL(returnPressed()), this, SLOT(gotReturn()));
+  // Close window after sending message
+  connect(this, SIGNAL(closeWindow()), this, SLOT(close()));
+}
+
+void PrivateMessage::gotReturn() {
+  QVariantMap *msg = new QVariantMap();
+  msg->insert(TYPE, MSG_PRIVATE);
+  msg->insert(DEST, destination);
+  msg->insert(CHATTEXT, msgText->toPlainText());
+  msg->insert(HOPLIMIT, DEFLIM);
+  emit sendPM(*msg);
+
+  // Close private message window
+  emit closeWindow();
+}
+#endif
+
+// PEER FUNCTIONS ------------------------------------------------
+Peer::Peer() {
+}
+
+Peer::Peer(QHostAddress h, quint16 p) {
+  host = h;
+  port = p;
+}
+
+bool Peer::isEqual(Peer p) {
+  return this->host == p.host && this->port == p.port;
+}
+
+bool Peer::operator==(const Peer p) {
+  return this->isEqual(p);
+}
+
+QString Peer::toString() {
+  return host.toString().append(QString(":")).append(QString::number(port));
+}
+
+// RINGID FUNCTIONS ---------------------------------------------
+
+RingId::RingId() {
+  for (int i = 0; i < WORDS; i++) {
+    words[i] = 0;
+  }
+}
+
+RingId::RingId(QByteArray digest) {
+  for (int i = 0; i < WORDS; i++) {
+    words[i] = 0;
+    for (int j = 0; j < 4; j++) {
+      int k = 4*i + j;
+      words[i] = (words[i] << 8) |
+        (k < digest.size() ? (quint8) digest.at(k) : 0);
+    }
+  }
+}
+
+RingId RingId::power(int bit) {
+  RingId r;
+  if (bit >= 0 && bit < BITS) {
+    r.words[WORDS - 1 - bit/32] = ((quint32) 1) << (bit%32);
+  }
+  return r;
+}
+
+RingId RingId::operator+(const RingId &o) const {
+  RingId r;
+  quint64 carry = 0;
+  for (int i = WORDS - 1; i >= 0; i--) {
+    quint64 sum = (quint64) words[i] + o.words[i] + carry;
+    r.words[i] = (quint32) sum;
+    carry = sum >> 32;
+  }
+  return r;
+}
+
+RingId RingId::operator-(const RingId &o) const {
+  RingId r;
+  quint64 borrow = 0;
+  for (int i = WORDS - 1; i >= 0; i--) {
+    quint64 diff = (quint64) words[i] - o.words[i] - borrow;
+    r.words[i] = (quint32) diff;
+    borrow = (diff >> 32) ? 1 : 0;
+  }
+  return r;
+}
+
+bool RingId::operator<(const RingId &o) const {
+  for (int i = 0; i < WORDS; i++) {
+    if (words[i] != o.words[i]) {
+      return words[i] < o.words[i];
+    }
+  }
+  return false;
+}
+
+bool RingId::operator==(const RingId &o) const {
+  for (int i = 0; i < WORDS; i++) {
+    if (words[i] != o.words[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RingId::operator!=(const RingId &o) const {
+  return !(*this == o);
+}
+
+QByteArray RingId::toByteArray() const {
+  QByteArray digest;
+  for (int i = 0; i < WORDS; i++) {
+    for (int j = 3; j >= 0; j--) {
+      digest.append((char) (words[i] >> (8*j)));
+    }
+  }
+  return digest;
+}
+
+QString RingId::toString() const {
+  return QString(toByteArray().toHex());
+}
+
+// FINGER TABLE FUNCTIONS ---------------------------------------------
+FingerTable::FingerTable() {
+  oneBehind = "";
+  hashCache = new QHash<QString, RingId>();
+  ring = new QMap<RingId, QString>();
+  vnodeCounts = new QHash<QString, int>();
+};
+
+FingerTable::FingerTable(QString originID) {
+  self = originID;
+  hashCache = new QHash<QString, RingId>();
+  ring = new QMap<RingId, QString>();
+  vnodeCounts = new QHash<QString, int>();
+  curHash = getHash(originID);
+  items = *(new QVector<FingerTableItem*>());
+  // Finger i covers [cur + 2^i, cur + 2^(i+1))
+  for (int i = 0; i < RingId::BITS; i++) {
+    FingerTableItem *item = new FingerTableItem();
+    item->intervalStart = curHash + RingId::power(i);
+    item->intervalEnd = curHash + RingId::power(i + 1);
+    items.push_back(item);
+  }
+  addNode(originID, 1);
+}
+
+RingId FingerTable::vnodeHash(QString id, int i) {
+  if (i == 0) {
+    return getHash(id);
+  }
+  return getHash(id + QString("#") + QString::number(i));
+}
+
+void FingerTable::addNode(QString originID, int vnodes) {
+  if (vnodes < 1) {
+    vnodes = 1;
+  }
+  int old = vnodeCounts->value(originID, 0);
+  for (int i = vnodes; i < old; i++) {
+    ring->remove(vnodeHash(originID, i));
+  }
+  for (int i = 0; i < vnodes; i++) {
+    ring->insert(vnodeHash(originID, i), originID);
+  }
+  vnodeCounts->insert(originID, vnodes);
+  rebuild();
+  qDebug() << " > added" << originID << "with" << vnodes << "vnodes";
+  printFingerTable();
+}
+
+void FingerTable::removeNode(QString originID) {
+  int old = vnodeCounts->value(originID, 0);
+  for (int i = 0; i < old; i++) {
+    ring->remove(vnodeHash(originID, i));
+  }
+  vnodeCounts->remove(originID);
+  rebuild();
+}
+
+QString FingerTable::ownerOf(RingId key) {
+  if (ring->isEmpty()) {
+    return "";
+  }
+  QMap<RingId, QString>::const_iterator it = ring->lowerBound(key);
+  if (it == ring->constEnd()) {
+    it = ring->constBegin();
+  }
+  return it.value();
+}
+
+RingId FingerTable::predecessorOf(RingId pos) {
+  QMap<RingId, QString>::const_iterator it = ring->lowerBound(pos);
+  if (it == ring->constBegin()) {
+    it = ring->constEnd();
+  }
+  if (it == ring->constBegin()) {
+    return pos;
+  }
+  --it;
+  return it.key();
+}
+
+QStringList FingerTable::replicasOf(RingId key, int r) {
+  QStringList replicas;
+  if (ring->isEmpty()) {
+    return replicas;
+  }
+  QMap<RingId, QString>::const_iterator it = ring->lowerBound(key);
+  if (it == ring->constEnd()) {
+    it = ring->constBegin();
+  }
+  QString owner = it.value();
+  // Walk forward from the owning vnode, skipping further vnodes of
+  // nodes already listed
+  for (int n = 1; n < ring->size() && replicas.size() < r; n++) {
+    ++it;
+    if (it == ring->constEnd()) {
+      it = ring->constBegin();
+    }
+    if (it.value() != owner && !replicas.contains(it.value())) {
+      replicas.append(it.value());
+    }
+  }
+  return replicas;
+}
+
+void FingerTable::rebuild() {
+  for (int i = 0; i < items.size(); i++) {
+    FingerTableItem *curItem = items.at(i);
+    QMap<RingId, QString>::const_iterator it =
+      ring->lowerBound(curItem->intervalStart);
+    if (it == ring->constEnd()) {
+      it = ring->constBegin();
+    }
+    if (it == ring->constEnd()) {
+      curItem->originID = self;
+      curItem->nodeHash = curHash;
+    } else {
+      curItem->originID = it.value();
+      curItem->nodeHash = it.key();
+    }
+  }
+
+  // Nearest other nodes either side of curHash; this node alone has
+  // itself on both sides
+  oneBehind = self;
+  behindHash = curHash;
+  oneAhead = self;
+  QMap<RingId, QString>::const_iterator back = ring->lowerBound(curHash);
+  QMap<RingId, QString>::const_iterator ahead = back;
+  for (int n = 0; n < ring->size(); n++) {
+    if (back == ring->constBegin()) {
+      back = ring->constEnd();
+    }
+    --back;
+    if (back.value() != self) {
+      oneBehind = back.value();
+      behindHash = back.key();
+      break;
+    }
+  }
+  for (int n = 0; n < ring->size(); n++) {
+    if (ahead == ring->constEnd()) {
+      ahead = ring->constBegin();
+    }
+    if (ahead.value() != self) {
+      oneAhead = ahead.value();
+      break;
+    }
+    ++ahead;
+  }
+
+  // Replica sets of keys near the change have shifted
+  emit ringChanged();
+}
+
+QString FingerTable::getPeerFromHash(RingId hash, QSet<QString> avoid) {
+  QString owner = ownerOf(hash);
+  if (owner == self) {
+    return owner;
+  }
+  // Route from whichever of this node's vnodes lies closest before hash
+  RingId from = curHash;
+  for (int i = 1; i < vnodeCounts->value(self, 1); i++) {
+    RingId pos = vnodeHash(self, i);
+    if (hash - pos < hash - from) {
+      from = pos;
+    }
+  }
+
+  // Take the furthest finger that stops short of hash, so that every hop
+  // at least halves the distance left; once none does, hash falls
+  // between from and its successor, the owner
+  RingId distance = hash - from;
+  for (int i = RingId::BITS - 1; i >= 0; i--) {
+    RingId pos;
+    QString node;
+    if (from == curHash) {
+      pos = items.at(i)->nodeHash;
+      node = items.at(i)->originID;
+    } else {
+      // Fingers of other vnodes are not kept, so find them in the ring
+      QMap<RingId, QString>::const_iterator it =
+        ring->lowerBound(from + RingId::power(i));
+      if (it == ring->constEnd()) {
+        it = ring->constBegin();
+      }
+      pos = it.key();
+      node = it.value();
+    }
+    RingId offset = pos - from;
+    if (offset != RingId() && offset < distance && !avoid.contains(node)) {
+      return node;
+    }
+  }
+  return owner;
+}
+
+void FingerTable::printFingerTable() {
+  qDebug() << " ----- Finger Table -----";
+  // Runs of fingers pointing at the same node are printed as one
+  for (int i = 0; i < items.size(); i++) {
+    FingerTableItem* curItem = items.at(i); 
+    int last = i;
+    while (last + 1 < items.size() &&
+           items.at(last + 1)->originID == curItem->originID) {
+      last++;
+    }
+    qDebug() << " FINGERS" << i << "-" << last << "\tORIGINID = "
+             << curItem->originID; 
+    i = last;
+  }
+  qDebug() << " ONE BEHIND = " << oneBehind << "\tONE AHEAD = " << oneAhead;
+  qDebug() << " VNODES IN RING = " << ring->size();
+  qDebug() << " ------------------------";
+}
+
+RingId FingerTable::getHash(QString originId) {
+  QHash<QString, RingId>::const_iterator cached = hashCache->find(originId);
+  if (cached != hashCache->constEnd()) {
+    return cached.value();
+  }
+
+  QCA::init(); 
+  QCA::Hash shaHash("sha1"); 
+  shaHash.update(originId.toUtf8()); 
+  RingId toReturn(shaHash.final().toByteArray()); 
+  // Search strings can be anything, so don't let them pile up
+  if (hashCache->size() >= HASHCACHEMAX) {
+    hashCache->clear();
+  }
+  hashCache->insert(originId, toReturn);
+  return toReturn; 
+}
+
+// FINGER TALBE ITEM FUNCTIONS -----------------------------------------
+FingerTableItem::FingerTableItem() {
+  originID = "";
+}
+
+// LOOKUP FUNCTIONS ------------------------------------------------
+
+Lookup::Lookup() {
+}
+
+// RECENCYLIST FUNCTIONS ------------------------------------------------
+
+RecencyList::RecencyList() {
+  head = NULL;
+  tail = NULL;
+}
+
+RecencyList::~RecencyList() {
+  qDeleteAll(entries);
+}
+
+void RecencyList::touch(QString filename) {
+  Entry *e = entries.value(filename, NULL);
+  if (e == NULL) {
+    e = new Entry();
+    e->filename = filename;
+    entries.insert(filename, e);
+  } else if (e == head) {
+    return;
+  } else {
+    unlink(e);
+  }
+  pushFront(e);
+}
+
+void RecencyList::remove(QString filename) {
+  Entry *e = entries.take(filename);
+  if (e == NULL) {
+    return;
+  }
+  unlink(e);
+  delete e;
+}
+
+bool RecencyList::contains(QString filename) const {
+  return entries.contains(filename);
+}
+
+QString RecencyList::last() const {
+  if (tail == NULL) {
+    return "";
+  }
+  return tail->filename;
+}
+
+int RecencyList::size() const {
+  return entries.size();
+}
+
+bool RecencyList::isEmpty() const {
+  return entries.isEmpty();
+}
+
+QStringList RecencyList::toList() const {
+  QStringList list;
+  for (Entry *e = head; e != NULL; e = e->next) {
+    list.append(e->filename);
+  }
+  return list;
+}
+
+void RecencyList::unlink(Entry *e) {
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  } else {
+    head = e->next;
+  }
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  } else {
+    tail = e->prev;
+  }
+  e->prev = NULL;
+  e->next = NULL;
+}
+
+void RecencyList::pushFront(Entry *e) {
+  e->prev = NULL;
+  e->next = head;
+  if (head != NULL) {
+    head->prev = e;
+  }
+  head = e;
+  if (tail == NULL) {
+    tail = e;
+  }
+}
+
+// EVICTIONPOLICY FUNCTIONS ------------------------------------------------
+
+EvictionPolicy::EvictionPolicy() {
+  hits = 0;
+  misses = 0;
+  evictions = 0;
+  rejections = 0;
+}
+
+EvictionPolicy::~EvictionPolicy() {
+}
+
+EvictionPolicy *EvictionPolicy::create(QString name) {
+  if (name == QString("lru")) {
+    return new LruPolicy();
+  } else if (name == QString("lfu")) {
+    return new LfuPolicy();
+  } else if (name == QString("2q")) {
+    return new TwoQueuePolicy();
+  } else if (name == QString("tinylfu")) {
+    return new TinyLfuPolicy();
+  }
+  return NULL;
+}
+
+bool EvictionPolicy::admit(QString candidate, QString victim) {
+  Q_UNUSED(candidate);
+  Q_UNUSED(victim);
+  return true;
+}
+
+void EvictionPolicy::lookedUp(QString filename, bool hit) {
+  if (hit) {
+    hits++;
+  } else {
+    misses++;
+    missed(filename);
+  }
+}
+
+double EvictionPolicy::hitRatio() const {
+  if (hits + misses == 0) {
+    return 0;
+  }
+  return (double) hits / (hits + misses);
+}
+
+void EvictionPolicy::missed(QString filename) {
+  Q_UNUSED(filename);
+}
+
+QString LruPolicy::name() const {
+  return "lru";
+}
+
+void LruPolicy::insert(QString filename) {
+  order.touch(filename);
+}
+
+void LruPolicy::touch(QString filename) {
+  if (order.contains(filename)) {
+    order.touch(filename);
+  }
+}
+
+void LruPolicy::remove(QString filename, bool evicted) {
+  Q_UNUSED(evicted);
+  order.remove(filename);
+}
+
+QString LruPolicy::victim() const {
+  return order.last();
+}
+
+QStringList LruPolicy::toList() const {
+  return order.toList();
+}
+
+LfuPolicy::LfuPolicy() {
+  tick = 0;
+  age = 0;
+}
+
+QString LfuPolicy::name() const {
+  return "lfu";
+}
+
+void LfuPolicy::insert(QString filename) {
+  if (ranks.contains(filename)) {
+    touch(filename);
+    return;
+  }
+  setCount(filename, age + 1);
+}
+
+void LfuPolicy::touch(QString filename) {
+  if (!ranks.contains(filename)) {
+    return;
+  }
+  setCount(filename, (ranks.value(filename) >> 32) + 1);
+}
+
+void LfuPolicy::remove(QString filename, bool evicted) {
+  if (!ranks.contains(filename)) {
+    return;
+  }
+  quint64 rank = ranks.take(filename);
+  byRank.remove(rank);
+  if (evicted) {
+    age = rank >> 32;
+  }
+}
+
+QString LfuPolicy::victim() const {
+  if (byRank.isEmpty()) {
+    return "";
+  }
+  return byRank.value(byRank.firstKey());
+}
+
+QStringList LfuPolicy::toList() const {
+  QStringList list;
+  QMapIterator<quint64, QString> it(byRank);
+  while (it.hasNext()) {
+    list.prepend(it.next().value());
+  }
+  return list;
+}
+
+void LfuPolicy::setCount(QString filename, quint32 count) {
+  if (ranks.contains(filename)) {
+    byRank.remove(ranks.value(filename));
+  }
+  quint64 rank = ((quint64) count << 32) | tick++;
+  ranks.insert(filename, rank);
+  byRank.insert(rank, filename);
+}
+
+QString TwoQueuePolicy::name() const {
+  return "2q";
+}
+
+void TwoQueuePolicy::insert(QString filename) {
+  if (recent.contains(filename) || frequent.contains(filename)) {
+    touch(filename);
+  } else if (ghosts.contains(filename)) {
+    // Evicted too soon last time
+    ghosts.remove(filename);
+    frequent.touch(filename);
+  } else {
+    recent.touch(filename);
+  }
+}
+
+void TwoQueuePolicy::touch(QString filename) {
+  if (frequent.contains(filename)) {
+    frequent.touch(filename);
+  } else if (recent.contains(filename)) {
+    recent.remove(filename);
+    frequent.touch(filename);
+  }
+}
+
+void TwoQueuePolicy::remove(QString filename, bool evicted) {
+  if (!recent.contains(filename)) {
+    frequent.remove(filename);
+    return;
+  }
+  recent.remove(filename);
+  if (evicted) {
+    ghosts.touch(filename);
+    int most = qMax(TWOQGHOSTMIN, recent.size() + frequent.size());
+    while (ghosts.size() > most) {
+      ghosts.remove(ghosts.last());
+    }
+  }
+}
+
+QString TwoQueuePolicy::victim() const {
+  int stored = recent.size() + frequent.size();
+  if (!recent.isEmpty() &&
+      (frequent.isEmpty() || recent.size() * TWOQFIFOSHARE > stored)) {
+    return recent.last();
+  }
+  return frequent.last();
+}
+
+QStringList TwoQueuePolicy::toList() const {
+  QStringList list = frequent.toList();
+  list.append(recent.toList());
+  return list;
+}
+
+TinyLfuPolicy::TinyLfuPolicy() {
+  counters.fill(0, SKETCHDEPTH * SKETCHWIDTH);
+  samples = 0;
+}
+
+QString TinyLfuPolicy::name() const {
+  return "tinylfu";
+}
+
+void TinyLfuPolicy::touch(QString filename) {
+  record(filename);
+  LruPolicy::touch(filename);
+}
+
+bool TinyLfuPolicy::admit(QString candidate, QString victim) {
+  return estimate(candidate) >= estimate(victim);
+}
+
+void TinyLfuPolicy::missed(QString filename) {
+  record(filename);
+}
+
+void TinyLfuPolicy::record(QString filename) {
+  for (int row = 0; row < SKETCHDEPTH; row++) {
+    int i = slot(filename, row);
+    if (counters.at(i) < SKETCHMAX) {
+      counters[i]++;
+    }
+  }
+  // Halve every count now and then, so that past popularity fades
+  if (++samples >= SKETCHRESET) {
+    for (int i = 0; i < counters.size(); i++) {
+      counters[i] /= 2;
+    }
+    samples /= 2;
+  }
+}
+
+int TinyLfuPolicy::estimate(QString filename) const {
+  int least = SKETCHMAX;
+  for (int row = 0; row < SKETCHDEPTH; row++) {
+    least = qMin(least, (int) counters.at(slot(filename, row)));
+  }
+  return least;
+}
+
+int TinyLfuPolicy::slot(QString filename, int row) const {
+  uint h = qHash(filename);
+  uint step = ((h >> 17) | (h << 15)) | 1;
+  return row * SKETCHWIDTH + ((h + row * step) & (SKETCHWIDTH - 1));
+}
+
+// NETSOCKET FUNCTIONS ------------------------------------------------
+
+NetSocket::NetSocket() {
+  // Pick a range of four UDP ports to try to allocate by default,
+  // computed based on my Unix user ID.
+  // This makes it trivial for up to four Peerster instances per user
+  // to find each other on the same host,
+  // barring UDP port conflicts with other applications
+  // (which are quite possible).
+  // We use the range from 32768 to 49151 for this purpose.
+  myPortMin = 32768 + (getuid() % 4096)*4;
+  myPortMax = myPortMin + 3;
+  seqNo = 1;
+  dhtSeqNo = 1;
+  noForward = false;
+  evictionPolicy = EvictionPolicy::create(DEFEVICTION); 
+  storeIndex = NULL;
+  dhtSizeLimit = 20 * 1024;
+  vnodeOverride = 0;
+  replicas = DEFREPLICAS;
+  ecData = 0;
+  ecParity = 0;
+  iterative = false;
+  leaving = false;
+  leaveTries = 0;
+  leaveTimer = new QTimer(this);
+  connect(leaveTimer, SIGNAL(timeout()), this, SLOT(gotLeaveTimeout()));
+
+  // Register a handler for each message type
+  handlers = new QHash<int, MsgHandler>();
+  addHandler(MSG_STATUS, &NetSocket::handleStatus);
+  addHandler(MSG_RUMOR, &NetSocket::handleRumor);
+  addHandler(MSG_PRIVATE, &NetSocket::handlePrivate);
+  addHandler(MSG_BLOCKREQ, &NetSocket::handleBlockReq);
+  addHandler(MSG_BLOCKREPLY, &NetSocket::handleBlockReply);
+  addHandler(MSG_SEARCH, &NetSocket::handleSearch);
+  addHandler(MSG_SEARCHREPLY, &NetSocket::handleSearchReply);
+  addHandler(MSG_TRANSFER, &NetSocket::handleTransfer);
+  addHandler(MSG_TRANSFERACK, &NetSocket::handleTransferAck);
+  addHandler(MSG_PING, &NetSocket::handlePing);
+  addHandler(MSG_PONG, &NetSocket::handlePong);
+  addHandler(MSG_FINDSUCC, &NetSocket::handleFindSucc);
+  addHandler(MSG_FINDSUCCREPLY, &NetSocket::handleFindSuccReply);
+  wireHandlers = new QHash<int, WireHandler>();
+  addWireHandler(MSG_BLOCKREQ, &NetSocket::handleWireBlockReq);
+  addWireHandler(MSG_BLOCKREPLY, &NetSocket::handleWireBlockReply);
+  connect(this, SIGNAL(readyRead()), this, SLOT(readMsg()));
+
+  sendQueue = new QList<QPair<QByteArray, Peer> >();
+  flushScheduled = false;
+  recvBuffer = new QByteArray(RECVBATCH * MAXDATAGRAM, 0);
+}
+
+
+
+bool NetSocket::bind() {
+  // Try to bind to each of the range myPortMin..myPortMax in turn.
   for (quint16 p = myPortMin; p <= myPortMax; p++) {
     if (QUdpSocket::bind(p)) {
       thisPort = p;
@@ -890,13 +2673,46 @@ bool NetSocket::bind() {
         originID = QString("Andrew").append(QString::number(qrand()));
         break;
       }
+      // Come back as the node this port was last time, so the keys in
+      // its store index are still its own, numbering its messages on from
+      // the last ones peers saw so that they still take them
+      StoreIndex *index = new StoreIndex(INDEXPREFIX + QString::number(p));
+      QList<StoreRecord> stored = index->load();
+      if (!stored.isEmpty() && stored.first().op == STORE_ORIGIN) {
+        originID = stored.first().key;
+        for (int i = 0; i < stored.size(); i++) {
+          if (stored.at(i).op == STORE_ORIGIN) {
+            seqNo = qMax(seqNo, stored.at(i).seqNo);
+            dhtSeqNo = qMax(dhtSeqNo, stored.at(i).dhtSeqNo);
+          }
+        }
+      }
       qDebug() << "\n" << originID << "bound to UDP port " << p;
 
-      fingerTable = new FingerTable(nSpots, originID); 
-      connect(fingerTable, SIGNAL(deleteRedundancies()),
-              this, SLOT(gotDeleteRedundancies()));
+      fingerTable = new FingerTable(originID); 
+      connect(fingerTable, SIGNAL(ringChanged()),
+              this, SLOT(gotRingChanged()));
+
+      // Liveness of ring neighbours and fingers
+      pingSent = new QHash<QString, qint64>();
+      suspected = new QSet<QString>();
+      presumedDead = new QSet<QString>();
+      ownerCache = new QHash<QByteArray, QPair<QString, qint64> >();
+      lookups = new QHash<QByteArray, Lookup*>();
+      relayCounts = new QHash<QString, int>();
+      relayWindowStart = 0;
+      hotPending = new QHash<QString, qint64>();
+      hotOrder = new RecencyList();
+      lookupTimer = new QTimer(this);
+      connect(lookupTimer, SIGNAL(timeout()),
+              this, SLOT(gotLookupTimeout()));
+      liveClock.start();
+      stabilizeTimer = new QTimer(this);
+      connect(stabilizeTimer, SIGNAL(timeout()),
+              this, SLOT(gotStabilizeTimeout()));
+      stabilizeTimer->start(STABILIZETICK);
       qDebug() << originID << "default hash:" <<
-        fingerTable->getHash(nSpots, originID);
+        fingerTable->getHash(originID).toString();
 
       // Initalize statuses
       status = new QVariantMap();
@@ -934,17 +2750,16 @@ bool NetSocket::bind() {
       while (it.hasNext()) {
         QString arg = it.next();
 
-        // Check for noforward flag
-        if (arg == QString("-noforward")) {
-          noForward = true;
-        } else {
-          // Turn other arguments to peers
+        // Turn non-option arguments to peers; options are applied by
+        // applyOption
+        if (!arg.startsWith(QChar('-'))) {
           argToPeer(arg);
         }
       }
 
       // Initialize routingTable
       routingTable = new QHash<QString, Peer*>();
+      binaryPeers = new QSet<QString>();
 
       // Broadcast single route rumor message
       broadcast(NULL, thisPeer);
@@ -959,15 +2774,35 @@ bool NetSocket::bind() {
       fileArchive = new QMap<QString, Files>();
       dhtArchive = new QMap<QString, Files>();
       redundancyArchive = new QMap<QString, Files>();
+      fragmentArchive = new QMap<QString, Files>();
+      hotArchive = new QMap<QString, Files>();
+      ownedKeys = new QMultiMap<RingId, QString>();
+      handoffs = new QHash<QString, QString>();
+      blockIndex = new QHash<QByteArray, QList<BlockLocation> >();
+      archiveBytes = new QHash<int, qint64>();
+      reservations = new QHash<QByteArray, QPair<int, qint64> >();
 
       // Initialize downloading information
-      downloading = false;
+      downloads = new QHash<QByteArray, DownloadFile*>();
 
       // Initialize DHT information
       joinDHT = false;
       hasJoinedDHT = false;
       dhtStatus = new QMap<QString, QPair<quint32, bool> >();
-
+      dhtVnodes = new QHash<QString, int>();
+      replicaHolders = new QHash<QString, QStringList>();
+      encoding = new QSet<QString>();
+      fragmentSets = new QHash<QString, QVariantMap>();
+      rebuilds = new QHash<QString, QMap<int, QString> >();
+      fragmentDownloads = new QHash<QByteArray, QPair<QString, int> >();
+
+      chunkStore = new ChunkStore(CHUNKPREFIX + QString::number(p) + ".");
+      chunkStore->open();
+      compactTimer = new QTimer(this);
+      connect(compactTimer, SIGNAL(timeout()),
+              this, SLOT(gotCompactTimeout()));
+      compactTimer->start(COMPACTTICK);
+      loadStore(index, stored);
       return true;
     }
   }
@@ -1009,74 +2844,702 @@ Peer NetSocket::getThisPeer() {
   return *thisPeer;
 }
 
-void NetSocket::incSeqNo() {
-  seqNo++;
+void NetSocket::incSeqNo() {
+  seqNo++;
+  logOrigin();
+}
+
+bool NetSocket::getNF() {
+  return noForward;
+}
+
+void NetSocket::setNF(bool nf) {
+  noForward = nf;
+}
+
+void NetSocket::setDHTSizeLimit(qint64 bytes) {
+  dhtSizeLimit = bytes;
+}
+
+bool NetSocket::applyOption(QString opt) {
+  QString name = opt.section(QChar('='), 0, 0);
+  QString value = opt.section(QChar('='), 1);
+
+  if (name == QString("-noforward")) {
+    setNF(true);
+  } else if (name == QString("-sizelimit")) {
+    qint64 limit;
+    if (!parseSize(value, &limit)) {
+      qDebug() << "error: size limit" << value << "is not a size";
+      return false;
+    }
+    setDHTSizeLimit(limit);
+  } else if (name == QString("-vnodes")) {
+    bool isNumeric = false;
+    int n = value.toInt(&isNumeric, 10);
+    if (!isNumeric || n < 1) {
+      qDebug() << "error: vnode count" << value << "is not a positive number";
+      return false;
+    }
+    setVnodes(n);
+  } else if (name == QString("-lookup")) {
+    if (value != QString("iterative") && value != QString("recursive")) {
+      qDebug() << "error: lookup mode" << value
+               << "is not iterative or recursive";
+      return false;
+    }
+    setIterative(value == QString("iterative"));
+  } else if (name == QString("-evict")) {
+    if (!setEvictionPolicy(value)) {
+      qDebug() << "error: eviction policy" << value
+               << "is not lru, lfu, 2q or tinylfu";
+      return false;
+    }
+  } else if (name == QString("-replicas")) {
+    bool isNumeric = false;
+    int n = value.toInt(&isNumeric, 10);
+    if (!isNumeric || n < 1) {
+      qDebug() << "error: replica count" << value << "is not a positive number";
+      return false;
+    }
+    setReplicas(n);
+  } else if (name == QString("-erasure")) {
+    QStringList parts = value.split(",");
+    bool kNumeric = false, mNumeric = false;
+    int k = parts.value(0).toInt(&kNumeric, 10);
+    int m = parts.value(1).toInt(&mNumeric, 10);
+    if (parts.size() != 2 || !kNumeric || !mNumeric || k < 1 || m < 1 ||
+        k + m > MAXFRAGMENTS) {
+      qDebug() << "error: erasure code" << value << "is not k,m with k + m <="
+               << MAXFRAGMENTS;
+      return false;
+    }
+    setErasure(k, m);
+  } else {
+    qDebug() << "error: unknown option" << opt;
+    return false;
+  }
+  return true;
+}
+
+// Archive message and update status
+void NetSocket::processMsg(QVariantMap *msg) {
+  QString msgOrigin = msg->value(ORIGIN).toString();
+  quint32 msgSeqNo = msg->value(SEQNO).toUInt();
+
+  // Archive msg
+  (*archive)[msgOrigin].insert(msgSeqNo, *msg);
+
+  // Update status
+  // NOTE: assumes msgSeqNo is currentSeqNo
+  (*status)[msgOrigin] = msgSeqNo + 1;
+}
+
+Peer* NetSocket::pickPeer(Peer sender) {
+  // If no (other) peers, return NULL
+  if (peerList.size() == 0 ||
+      (!sender.isEqual(*thisPeer) && peerList.size() <= 1)) {
+    return NULL;
+  }
+
+  Peer *peer = new Peer();
+  qsrand(time(NULL));	
+  do {
+    *peer = peerList[qrand() % peerList.size()];
+  } while ((*peer).isEqual(sender)); // Don't send to port received from
+
+  return peer;
+}
+
+void NetSocket::monger(QVariantMap *msg, Peer *p) {
+  if (p != NULL) {
+    sendMsg(msg, *p);
+
+    // Set timer
+    QTimer *t = new QTimer(this);
+    connect(t, SIGNAL(timeout()), this, SLOT(gotTimeout()));
+    t->start(2000);
+    timerList->push_back(t);
+  }
+}
+
+// Send a datagram of msg to the given peer
+void NetSocket::sendMsg(QVariantMap *msg, Peer p) {
+  // Send message if this peerster is a forwarding peerster, OR
+  // if msg is a status, from this peerster, or a route rumor
+  if (!noForward ||
+      ((msg->find(WANT) != msg->end()) ||
+       (msg->value(ORIGIN).toString() == originID) ||
+       (msg->find(CHATTEXT) == msg->end()))) {
+    QByteArray a;
+    if (binaryPeers->contains(p.toString())) {
+      a = WireMessage::encode(*msg);
+    }
+    if (a.isEmpty()) {
+      // Legacy format, for peers that have not shown they understand
+      // the binary one
+      QDataStream s(&a, QIODevice::WriteOnly);
+      s << *msg;
+    }
+    queueDatagram(a, p);
+  }
+}
+
+void NetSocket::queueDatagram(QByteArray datagram, Peer p) {
+  sendQueue->append(qMakePair(datagram, p));
+  if (sendQueue->size() >= SENDBATCH) {
+    flushSends();
+  } else if (!flushScheduled) {
+    // Send whatever has queued up once control returns to the event loop
+    flushScheduled = true;
+    QTimer::singleShot(0, this, SLOT(flushSends()));
+  }
+}
+
+void NetSocket::flushSends() {
+  flushScheduled = false;
+  int sent = 0;
+#ifdef Q_OS_LINUX
+  // Hand IPv4 datagrams to the kernel SENDBATCH at a time
+  struct mmsghdr msgs[SENDBATCH];
+  struct iovec iovs[SENDBATCH];
+  struct sockaddr_in addrs[SENDBATCH];
+  while (sent < sendQueue->size()) {
+    int n = 0;
+    while (n < SENDBATCH && sent + n < sendQueue->size()) {
+      const QPair<QByteArray, Peer> &out = sendQueue->at(sent + n);
+      if (out.second.host.protocol() != QAbstractSocket::IPv4Protocol) {
+        break;
+      }
+      memset(&msgs[n], 0, sizeof(msgs[n]));
+      memset(&addrs[n], 0, sizeof(addrs[n]));
+      addrs[n].sin_family = AF_INET;
+      addrs[n].sin_port = htons(out.second.port);
+      addrs[n].sin_addr.s_addr = htonl(out.second.host.toIPv4Address());
+      iovs[n].iov_base = (void *) out.first.constData();
+      iovs[n].iov_len = out.first.size();
+      msgs[n].msg_hdr.msg_name = &addrs[n];
+      msgs[n].msg_hdr.msg_namelen = sizeof(addrs[n]);
+      msgs[n].msg_hdr.msg_iov = &iovs[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+      n++;
+    }
+    if (n == 0) {
+      break;
+    }
+    int r = sendmmsg(socketDescriptor(), msgs, n, 0);
+    if (r <= 0) {
+      qDebug() << "error: batched send failed, errno" << errno;
+      break;
+    }
+    sent += r;
+  }
+#endif
+  // Anything left over goes out one datagram at a time
+  for (; sent < sendQueue->size(); sent++) {
+    const QPair<QByteArray, Peer> &out = sendQueue->at(sent);
+    writeDatagram(out.first.constData(), out.first.size(),
+                  out.second.host, out.second.port);
+  }
+  sendQueue->clear();
+}
+
+void NetSocket::receiveBatch(QList<QPair<QByteArray, Peer> > *batch) {
+#ifdef Q_OS_LINUX
+  struct mmsghdr msgs[RECVBATCH];
+  struct iovec iovs[RECVBATCH];
+  struct sockaddr_in addrs[RECVBATCH];
+  char *buf = recvBuffer->data();
+  for (int i = 0; i < RECVBATCH; i++) {
+    iovs[i].iov_base = buf + i * MAXDATAGRAM;
+    iovs[i].iov_len = MAXDATAGRAM;
+  }
+
+  int r = RECVBATCH;
+  while (r == RECVBATCH) {
+    for (int i = 0; i < RECVBATCH; i++) {
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    r = recvmmsg(socketDescriptor(), msgs, RECVBATCH, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < r; i++) {
+      if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+          addrs[i].sin_family != AF_INET) {
+        qDebug() << "error: dropping oversized or non-IPv4 datagram";
+        continue;
+      }
+      Peer p(QHostAddress(ntohl(addrs[i].sin_addr.s_addr)),
+             ntohs(addrs[i].sin_port));
+      batch->append(qMakePair(QByteArray(buf + i * MAXDATAGRAM,
+                                         msgs[i].msg_len), p));
+    }
+  }
+#else
+  Q_UNUSED(batch);
+#endif
+}
+
+QVariantMap NetSocket::decodeMsg(QByteArray datagram, Peer p,
+                                 WireMessage *wire) {
+  QVariantMap msg;
+  if (wire != NULL) {
+    msg = wire->toMap();
+  } else {
+    QDataStream s(&datagram, QIODevice::ReadOnly);
+    s >> msg;
+  }
+
+  // Peers advertise the binary format in their statuses
+  if (msg.value(CODEC).toUInt() >= WIREVERSION) {
+    binaryPeers->insert(p.toString());
+  }
+  return msg;
+}
+
+void NetSocket::readMsg() {
+  while (hasPendingDatagrams()) {
+    // Read incoming datagram. Qt only re-arms its read notifier from
+    // readDatagram, so the first datagram goes through it and the rest
+    // of the burst is drained in batches.
+    QByteArray datagram;
+    datagram.resize(pendingDatagramSize());
+    QHostAddress sender;
+    quint16 senderPort;
+
+    readDatagram(datagram.data(), datagram.size(), &sender, &senderPort);
+
+    QList<QPair<QByteArray, Peer> > batch;
+    batch.append(qMakePair(datagram, Peer(sender, senderPort)));
+    receiveBatch(&batch);
+
+    for (int i = 0; i < batch.size(); i++) {
+      processDatagram(batch.at(i).first, batch.at(i).second);
+    }
+  }
+}
+
+void NetSocket::processDatagram(QByteArray datagram, Peer p) {
+  // Learn new peers
+  learnPeer(p.host, p.port);
+
+  Peer *senderPeer = new Peer(p.host, p.port);
+
+  WireMessage wire;
+  bool binary = wire.parse(datagram);
+  if (binary) {
+    WireHandler wireHandler = wireHandlers->value(wire.type, NULL);
+    if (wireHandler != NULL) {
+      (this->*wireHandler)(&wire, senderPeer);
+      return;
+    }
+  }
+  QVariantMap msg = decodeMsg(datagram, *senderPeer, binary ? &wire : NULL);
+
+  // Dispatch on message type, inferring it for peers that don't send it
+  int type = msg.value(TYPE).toInt();
+  if (type == MSG_UNTYPED) {
+    type = classify(msg);
+  }
+  MsgHandler handler = handlers->value(type, NULL);
+  if (handler != NULL) {
+    (this->*handler)(msg, senderPeer);
+  } else {
+    // Missing datagram fields
+    sendStatus(senderPeer);
+  }
+}
+
+void NetSocket::addHandler(int type, MsgHandler handler) {
+  handlers->insert(type, handler);
+}
+
+void NetSocket::addWireHandler(int type, WireHandler handler) {
+  wireHandlers->insert(type, handler);
+}
+
+int NetSocket::classify(QVariantMap msg) {
+  if (isTransferRequest(msg)) {
+    return MSG_TRANSFER;
+  } else if (isP2P(msg)) {
+    if (msg.contains(CHATTEXT)) {
+      return MSG_PRIVATE;
+    } else if (msg.contains(BLOCKREQ)) {
+      return MSG_BLOCKREQ;
+    } else if (msg.contains(BLOCKREPLY)) {
+      return MSG_BLOCKREPLY;
+    }
+    return MSG_SEARCHREPLY;
+  } else if (isSearchReq(msg)) {
+    return MSG_SEARCH;
+  } else if (msg.contains(ORIGIN) && msg.contains(SEQNO)) {
+    return MSG_RUMOR;
+  } else if (msg.contains(WANT)) {
+    return MSG_STATUS;
+  }
+  return MSG_UNTYPED;
+}
+
+bool NetSocket::isForMe(QVariantMap msg) {
+  if (msg.value(DEST).toString() == originID) {
+    return true;
+  }
+  if (!noForward && msg.value(HOPLIMIT).toUInt() > 1) {
+    // Forward if a forwarding peer
+    forwardP2P(msg);
+  }
+  // NOTE: Discards msg that has reached the end of its hop limit
+  return false;
+}
+
+void NetSocket::handleTransfer(QVariantMap msg, Peer *senderPeer) {
+  Q_UNUSED(senderPeer);
+  qDebug() << "<<<<<<<<<<<<< got transfer request message for file"
+           << msg[FILENAME].toString();
+  doTransferRequest(msg);
+}
+
+void NetSocket::handlePing(QVariantMap msg, Peer *senderPeer) {
+  Q_UNUSED(senderPeer);
+  if (!isForMe(msg)) {
+    return;
+  }
+  sendProbe(MSG_PONG, msg.value(ORIGIN).toString());
+}
+
+void NetSocket::handlePong(QVariantMap msg, Peer *senderPeer) {
+  Q_UNUSED(senderPeer);
+  if (!isForMe(msg)) {
+    return;
+  }
+  QString node = msg.value(ORIGIN).toString();
+  pingSent->remove(node);
+  if (suspected->remove(node)) {
+    // Offer it what was held for it while it was silent
+    QHashIterator<QString, QString> it(*handoffs);
+    while (it.hasNext()) {
+      it.next();
+      Files held = redundancyArchive->value(it.key());
+      if (it.value() == node && !held.blocklist.isEmpty()) {
+        offerFile(it.key(), node, held.blocklistHash);
+      }
+    }
+  }
+  if (presumedDead->remove(node) && dhtStatus->value(node).second &&
+      !fingerTable->vnodeCounts->contains(node)) {
+    qDebug() << "<<<<<<<<<<<<<" << node << "is alive after all";
+    addToFingerTable(node, dhtVnodes->value(node, 1));
+  }
+}
+
+void NetSocket::handleFindSucc(QVariantMap msg, Peer *senderPeer) {
+  Q_UNUSED(senderPeer);
+  if (!isForMe(msg)) {
+    return;
+  }
+  // Name the node this one would send the key to; naming itself means
+  // it owns the key. Nodes outside the DHT know nothing of the ring.
+  RingId key(msg.value(FILEHASH).toByteArray());
+  QString next;
+  if (hasJoinedDHT && !leaving) {
+    next = routeTarget(key);
+  }
+  QVariantMap *reply = new QVariantMap();
+  reply->insert(TYPE, MSG_FINDSUCCREPLY);
+  reply->insert(DEST, msg.value(ORIGIN));
+  reply->insert(ORIGIN, originID);
+  reply->insert(HOPLIMIT, DEFLIM);
+  reply->insert(FILEHASH, key.toByteArray());
+  reply->insert(NEXTNODE, next);
+  sendToNode(reply, msg.value(ORIGIN).toString());
+}
+
+void NetSocket::handleFindSuccReply(QVariantMap msg, Peer *senderPeer) {
+  Q_UNUSED(senderPeer);
+  if (!isForMe(msg)) {
+    return;
+  }
+  Lookup *lookup = lookups->value(msg.value(FILEHASH).toByteArray());
+  if (lookup == NULL) {
+    // Answer to a lookup already finished
+    return;
+  }
+  QString node = msg.value(ORIGIN).toString();
+  QString next = msg.value(NEXTNODE).toString();
+  lookup->inFlight.remove(node);
+  if (next == node) {
+    finishLookup(lookup, node);
+    return;
+  }
+  if (!next.isEmpty() && !lookup->queried.contains(next)) {
+    // Closer than anything known so far
+    lookup->candidates.removeAll(next);
+    lookup->candidates.prepend(next);
+  }
+  advanceLookup(lookup);
+}
+
+void NetSocket::handleTransferAck(QVariantMap msg, Peer *senderPeer) {
+  Q_UNUSED(senderPeer);
+  if (!isForMe(msg)) {
+    return;
+  }
+  QString filename = msg.value(FILENAME).toString();
+  cacheOwner(fingerTable->getHash(filename), msg.value(ORIGIN).toString());
+  if (handoffs->value(filename) != msg.value(ORIGIN).toString()) {
+    return;
+  }
+  qDebug() << "<<<<<<<<<<<<<" << msg.value(ORIGIN).toString()
+           << "has taken over" << filename;
+  handoffs->remove(filename);
+  // Keep the copy if this node is now one of the new owner's replicas
+  RingId key = fingerTable->getHash(filename);
+  if (leaving || isErasureCoded(redundancyArchive->value(filename)) ||
+      !fingerTable->replicasOf(key, replicas).contains(originID)) {
+    evictionPolicy->remove(filename, false);
+    QString fileToDelete = "red_" + filename;
+    remove(fileToDelete.toStdString().c_str());
+    unarchiveFile(REDUNDANCY_ARCHIVE, filename);
+  }
+  if (leaving && handoffs->isEmpty()) {
+    finishLeave();
+  }
+}
+
+void NetSocket::handlePrivate(QVariantMap msg, Peer *senderPeer) {
+  Q_UNUSED(senderPeer);
+  if (isForMe(msg)) {
+    // Display PM
+    emit chatText(msg.value(ORIGIN).toString().append(QString(" (PM)")),
+                  msg.value(CHATTEXT).toString());
+  }
+}
+
+void NetSocket::handleBlockReq(QVariantMap msg, Peer *senderPeer) {
+  if (!isForMe(msg)) {
+    return;
+  }
+  serveBlock(msg.value(ORIGIN).toString(),
+             msg.value(BLOCKREQ).toByteArray(), senderPeer);
+}
+
+void NetSocket::handleWireBlockReq(WireMessage *wire, Peer *senderPeer) {
+  if (wire->string(DEST) != originID) {
+    // Forwarding rewrites the hop limit, so it takes the map form
+    handleBlockReq(wire->toMap(), senderPeer);
+    return;
+  }
+  serveBlock(wire->string(ORIGIN), wire->bytes(BLOCKREQ), senderPeer);
+}
+
+void NetSocket::serveBlock(QString origin, QByteArray blockReq,
+                           Peer *senderPeer) {
+  // A BlockRequest can be the hash of either a data block
+  // or a blocklist metafile
+  /*
+    qDebug() << "received block request from" << origin << "asking for"
+    << blockReq.toHex();
+  */
+  // Find block or blocklist metadata
+  // from internal database
+  QByteArray foundBlock = findBlock(blockReq);
+  if (!(foundBlock.isEmpty())) {
+    // Send reply
+    QVariantMap *rep = new QVariantMap();
+    rep->insert(TYPE, MSG_BLOCKREPLY);
+    rep->insert(ORIGIN, originID);
+    rep->insert(DEST, origin);
+    rep->insert(BLOCKREPLY, blockReq);
+    rep->insert(DATA, foundBlock);
+    rep->insert(HOPLIMIT, DEFLIM);
+    // Tell the downloader who else it can fetch the file from
+    QStringList holders = holdersOf(blockReq);
+    if (!holders.isEmpty()) {
+      rep->insert(HOLDERS, holders);
+    }
+
+    sendMsg(rep, *senderPeer);
+  } else {
+    // qDebug() << "did not send reply";
+  }
+}
+
+void NetSocket::handleBlockReply(QVariantMap msg, Peer *senderPeer) {
+  Q_UNUSED(senderPeer);
+  if (!isForMe(msg)) {
+    return;
+  }
+  takeBlock(msg.value(ORIGIN).toString(),
+            msg.value(BLOCKREPLY).toByteArray(),
+            msg.value(DATA).toByteArray(),
+            msg.value(HOLDERS).toStringList());
+}
+
+void NetSocket::handleWireBlockReply(WireMessage *wire, Peer *senderPeer) {
+  if (wire->string(DEST) != originID) {
+    handleBlockReply(wire->toMap(), senderPeer);
+    return;
+  }
+  takeBlock(wire->string(ORIGIN), wire->bytes(BLOCKREPLY),
+            wire->bytes(DATA), wire->strings(HOLDERS));
+}
+
+void NetSocket::takeBlock(QString origin, QByteArray blockReply,
+                          QByteArray data, QStringList holders) {
+  /*
+    qDebug() << originID << "received block reply from" << origin
+    << "asking for" << blockReply.toHex();
+  */
+  // Check that this data is expected
+  QList<DownloadFile*> awaiting = findDownloads(blockReply, origin);
+  if (awaiting.isEmpty()) {
+    // qDebug() << "received unrequested reply"; // DEBUG
+    return;
+  }
+
+  // Check that hash of data == blockReply
+  QCA::init();
+  if (!QCA::isSupported("sha1")) {
+    qDebug() << "error: SHA-1 not supported";
+    return;
+  }
+  QCA::Hash shaHash("sha1");
+  shaHash.update(data);
+  if (shaHash.final().toByteArray() == blockReply) {
+    // Both may share a datagram's buffer; the hash is kept as a chunk
+    // store key, the data only by a metafile's download
+    blockReply.detach();
+    for (int i = 0; i < awaiting.size(); i++) {
+      for (int j = 0; j < holders.size(); j++) {
+        addDownloadSource(awaiting.at(i), holders.at(j));
+      }
+      processBlockReply(awaiting.at(i), origin, blockReply, data);
+    }
+  } else {
+    // Discard message where hashes don't agree
+    qDebug() << "error:" << originID << "hashes not equal";
+    qDebug() << " > requestedBlock = " << blockReply.toHex()
+             << " and data when hashed = "
+             << shaHash.final().toByteArray().toHex();
+  }
+}
+
+void NetSocket::handleSearchReply(QVariantMap msg, Peer *senderPeer) {
+  Q_UNUSED(senderPeer);
+  if (isForMe(msg)) {
+    // The replier owns, or holds a replica of, the key searched for
+    cacheOwner(fingerTable->getHash(msg.value(SEARCHREP).toString()),
+               msg.value(ORIGIN).toString());
+    if (hotPending->contains(msg.value(SEARCHREP).toString())) {
+      // Our own search for a hot file, not the user's
+      fetchHotCopy(msg);
+      return;
+    }
+    emit searchReply(msg);
+  }
+}
+
+void NetSocket::handleSearch(QVariantMap msg, Peer *senderPeer) {
+  // Search for string and send search reply if matches found
+  QString filename = msg[SEARCH].toString(); 
+  RingId fileHash = fingerTable->getHash(filename); 
+  qDebug() << "<<<<<<<<<<<<< received search for filename"
+           << filename << "with hash" << fileHash.toString(); 
+
+  bool responsible = isMyDHTRequest(fileHash) ||
+    haveRedundantCopy(filename) || standInFor(fileHash) == originID;
+  if (responsible || haveHotCopy(filename)) {
+    qDebug() << originID << "the search is for me"; 
+    if (responsible) {
+      evictionPolicy->lookedUp(filename,
+        !dhtArchive->value(filename).blocklist.isEmpty() ||
+        (haveRedundantCopy(filename) &&
+         !redundancyArchive->value(filename).blocklist.isEmpty()));
+    }
+    processSearchReq(msg, *senderPeer); 
+  } else {
+    sendThroughFingerTable(&msg, fileHash); 
+    qDebug() << originID << "passing search through finger table";
+    noteRelay(filename);
+  }
 }
 
-bool NetSocket::getNF() {
-  return noForward;
+void NetSocket::handleStatus(QVariantMap msg, Peer *senderPeer) {
+  processStatus(msg, *senderPeer);
 }
 
-// Archive message and update status
-void NetSocket::processMsg(QVariantMap *msg) {
-  QString msgOrigin = msg->value(ORIGIN).toString();
-  quint32 msgSeqNo = msg->value(SEQNO).toUInt();
+void NetSocket::handleRumor(QVariantMap msg, Peer *senderPeer) {
+  if (!isMsgOrRouteOrDHT(msg, senderPeer)) {
+    // Unwanted SeqNo
+    sendStatus(senderPeer);
+    return;
+  }
 
-  // Archive msg
-  (*archive)[msgOrigin].insert(msgSeqNo, *msg);
+  // Display message
+  if (msg.find(CHATTEXT) != msg.end()) {
+    emit chatText(msg.value(ORIGIN).toString(),
+                  msg.value(CHATTEXT).toString());
+  }
 
-  // Update status
-  // NOTE: assumes msgSeqNo is currentSeqNo
-  (*status)[msgOrigin] = msgSeqNo + 1;
-}
+  // Add to routingTable
+  addToRT(msg.value(ORIGIN).toString(), senderPeer);
 
-Peer* NetSocket::pickPeer(Peer sender) {
-  // If no (other) peers, return NULL
-  if (peerList.size() == 0 ||
-      (!sender.isEqual(*thisPeer) && peerList.size() <= 1)) {
-    return NULL;
-  }
+  if (msg.find(JOINDHT) == msg.end()) {
+    // If chat msg or route rumor
 
-  Peer *peer = new Peer();
-  qsrand(time(NULL));	
-  do {
-    *peer = peerList[qrand() % peerList.size()];
-  } while ((*peer).isEqual(sender)); // Don't send to port received from
+    // Archive message, update status
+    processMsg(&msg);
+	
+    // Add last public IP address to peerList
+    QHostAddress h;
+    if (msg.find(LASTIP) != msg.end() && 
+        msg.find(LASTPORT) != msg.end()) {
+      h = QHostAddress(msg[LASTIP].toUInt());
+      learnPeer(h, msg[LASTPORT].toUInt());
+    }
+		
+    // Set last public IP address
+    msg.remove(LASTIP);
+    msg.remove(LASTPORT);
+    quint32 ip = senderPeer->host.toIPv4Address();
+    msg.insert(LASTIP, ip);
+    msg.insert(LASTPORT, senderPeer->port);
 
-  return peer;
-}
+    // Send back status
+    sendStatus(senderPeer);
+  } else {
+    // Process join DHT request
 
-void NetSocket::monger(QVariantMap *msg, Peer *p) {
-  if (p != NULL) {
-    sendMsg(msg, *p);
+    // Update dhtStatus
+    updateDhtStatus(&msg);
 
-    // Set timer
-    QTimer *t = new QTimer(this);
-    connect(t, SIGNAL(timeout()), this, SLOT(gotTimeout()));
-    t->start(2000);
-    timerList->push_back(t);
+    if (msg.value(JOINDHT).toBool()) {
+      // If senderPeer wants to join DHT, process
+      processJoinReq(msg, senderPeer);
+    } else {
+      // If wants to leave DHT, update finger table
+      processLeaveReq(msg);
+    }
   }
-}
 
-// Send a datagram of msg to the given peer
-void NetSocket::sendMsg(QVariantMap *msg, Peer p) {
-  // Send message if this peerster is a forwarding peerster, OR
-  // if msg is a status, from this peerster, or a route rumor
-  if (!noForward ||
-      ((msg->find(WANT) != msg->end()) ||
-       (msg->value(ORIGIN).toString() == originID) ||
-       (msg->find(CHATTEXT) == msg->end()))) {
-    QByteArray a;
-    QDataStream s(&a, QIODevice::WriteOnly);
-    s << *msg;
-    writeDatagram(a.data(), a.size(), p.host, p.port);
+  // Monger msg, or broadcast route rumor or dht join request
+  if (msg.find(CHATTEXT) != msg.end()) {
+    monger(&msg, pickPeer(*senderPeer));
+  } else {
+    msg.insert(BROADCAST, true);
+    broadcast(&msg, senderPeer);
   }
 }
 
 void NetSocket::sendStatus(Peer *p) {
   if (p != NULL) {
     QVariantMap *msg = new QVariantMap();
+    msg->insert(TYPE, MSG_STATUS);
     msg->insert(WANT, *status);
+    // Advertise that this peer understands the binary wire format
+    msg->insert(CODEC, (quint32) WIREVERSION);
     sendMsg(msg, *p);
   }
 }
@@ -1239,17 +3702,71 @@ void NetSocket::gotRouteTimeout() {
 }
 
 void NetSocket::gotRetransmit() {
-  sendMsg(dfile->msg, dfile->dest);
-  dfile->retransmit->start(2000);
+  // Find the download whose timer fired
+  DownloadFile *d = NULL;
+  QHashIterator<QByteArray, DownloadFile*> dit(*downloads);
+  while (dit.hasNext()) {
+    if (dit.next().value()->retransmit == sender()) {
+      d = dit.value();
+      break;
+    }
+  }
+  if (d == NULL) {
+    return;
+  }
+
+  // Take back every request that has been outstanding for too long,
+  // shrinking the window of the source that did not answer it
+  qint64 now = d->clock.elapsed();
+  QMapIterator<qint64, QPair<qint64, int> > it(*(d->outstanding));
+  while (it.hasNext()) {
+    it.next();
+    if (now - it.value().first < RETRANSMIT) {
+      continue;
+    }
+    DownloadSource &src = d->sources[it.value().second];
+    src.inFlight--;
+    src.window = qMax(1, src.window / 2);
+    src.timeouts++;
+    if (src.timeouts >= MAXTIMEOUTS && !src.failed) {
+      qDebug() << " > source" << src.originID << "stopped answering";
+      src.failed = true;
+    }
+    d->outstanding->remove(it.key());
+    if (it.key() < 0) {
+      // Only the target node is known until the metafile arrives
+      sendBlockReq(d, -1, 0);
+    } else {
+      d->pending->append(it.key());
+    }
+  }
+
+  // If every source has failed, keep trying all of them
+  bool allFailed = true;
+  for (int i = 0; i < d->sources.size(); i++) {
+    allFailed = allFailed && d->sources.at(i).failed;
+  }
+  if (allFailed) {
+    for (int i = 0; i < d->sources.size(); i++) {
+      d->sources[i].failed = false;
+      d->sources[i].timeouts = 0;
+    }
+  }
+
+  if (!d->file->blocklist.isEmpty()) {
+    fillWindow(d);
+  }
 }
 
 void NetSocket::sendRoute(Peer p) {
   //	qDebug() << originID << "sending route to peer " << p.toString();
 
   QVariantMap *msg = new QVariantMap();
+  msg->insert(TYPE, MSG_RUMOR);
   msg->insert(ORIGIN, originID);
   // Send SeqNo of last sent message
   msg->insert(SEQNO, seqNo++);
+  logOrigin();
   // Archive msg and update status
   processMsg(msg);
   // Send route rumor to peer
@@ -1300,19 +3817,14 @@ void NetSocket::addToRT(QString origin, Peer *p) {
   if (origin != originID) {
     // Remove any instances of the origin in the routingTable
     if (routingTable->remove(origin) == 0) {
-      // Add to originList if new
-      originList->addItem(origin);
-      originList->setCurrentIndex(-1);
+      // Report origin if new
+      emit newOrigin(origin);
     }
     // Add to routingTable
     routingTable->insert(origin, p);
   }
 }
 
-void NetSocket::resetOL() {
-  originList->setCurrentIndex(-1);
-}
-
 void NetSocket::gotSendPM(QVariantMap msg) {
   msg.insert(ORIGIN, originID);
 
@@ -1338,14 +3850,15 @@ void NetSocket::gotShareFiles(FileSharing *share) {
     Files file = it.next();
 
     QVariantMap *msg = new QVariantMap();
-    int fileHash = fingerTable->getHash(nSpots, file.filename);
+    RingId fileHash = fingerTable->getHash(file.filename);
+    msg->insert(TYPE, MSG_TRANSFER);
     msg->insert(ORIGIN, originID);
     msg->insert(FILENAME, file.filename);
-    msg->insert(FILEHASH, fileHash);
+    msg->insert(FILEHASH, fileHash.toByteArray());
     msg->insert(BLOCKLISTHASH, file.blocklistHash);
 
     if (!fileArchive->contains(file.filename)) {
-      fileArchive->insert(file.filename, file);
+      archiveFile(FILE_ARCHIVE, file.filename, file);
     }
     if (isMyDHTRequest(fileHash)) {
       // Add file to own dhtArchive
@@ -1358,23 +3871,201 @@ void NetSocket::gotShareFiles(FileSharing *share) {
 }
 
 void NetSocket::sendThroughFingerTable(QVariantMap *msg) {
-  QString dest = fingerTable->getPeerFromHash(((*msg)[FILEHASH]).toInt());
+  RingId hash(msg->value(FILEHASH).toByteArray());
+  if (standInFor(hash) == originID) {
+    // This node takes the file for its silent owner
+    doTransferRequest(*msg);
+    return;
+  }
+  if (iterative) {
+    startLookup(hash, *msg);
+    return;
+  }
+  QString dest = routeTarget(hash);
+  QString standIn = standInFor(hash);
+  if (!standIn.isEmpty() && dest == standIn) {
+    // The stand-in may not suspect the owner yet
+    msg->insert(STANDIN, dest);
+  }
 
   qDebug() << " > sending file" << msg->value(FILENAME).toString()
            << "to " << dest;
+  sendToNode(msg, dest);
+}
+
+
+// for DHT search requests
+void NetSocket::sendThroughFingerTable(QVariantMap *msg, RingId hash) {
+  if (iterative) {
+    startLookup(hash, *msg);
+    return;
+  }
+  QString dest = routeTarget(hash); 
+  qDebug() << " > sending search to " << dest;
+  sendToNode(msg, dest);
+}
+
+void NetSocket::sendToNode(QVariantMap *msg, QString dest) {
   // Find originID in routing table
   Peer *peer = routingTable->value(dest);
+  if (peer == NULL) {
+    qDebug() << " > no route to" << dest;
+    return;
+  }
   // Send to that peer
   sendMsg(msg, *peer);
 }
 
+void NetSocket::setIterative(bool on) {
+  iterative = on;
+}
 
-// for DHT search requests
-void NetSocket::sendThroughFingerTable(QVariantMap *msg, int hash) {
-  QString dest = fingerTable->getPeerFromHash(hash); 
-  qDebug() << " > sending search to " << dest;
-  Peer *peer = routingTable->value(dest); 
-  sendMsg(msg, *peer); 
+void NetSocket::startLookup(RingId key, QVariantMap msg) {
+  QString cached = cachedOwner(key);
+  if (!cached.isEmpty()) {
+    sendToNode(&msg, cached);
+    return;
+  }
+  Lookup *lookup = lookups->value(key.toByteArray());
+  if (lookup != NULL) {
+    lookup->pending.append(msg);
+    return;
+  }
+  QString next = fingerTable->getPeerFromHash(key, *suspected);
+  if (next == fingerTable->ownerOf(key) && !suspected->contains(next)) {
+    // No finger lies between this node and the owner, so there is
+    // nobody closer to ask
+    sendToNode(&msg, next);
+    return;
+  }
+  lookup = new Lookup();
+  lookup->key = key;
+  lookup->pending.append(msg);
+
+  // Start from the finger a recursive lookup would go through, then the
+  // other fingers nearest below key; each one asked names a finger of
+  // its own closer still
+  lookup->candidates.append(next);
+  QMap<RingId, QString> preceding;
+  for (int i = 0; i < fingerTable->items.size(); i++) {
+    FingerTableItem *item = fingerTable->items.at(i);
+    preceding.insert(key - item->nodeHash, item->originID);
+  }
+  QMapIterator<RingId, QString> it(preceding);
+  while (it.hasNext()) {
+    QString node = it.next().value();
+    if (!lookup->candidates.contains(node)) {
+      lookup->candidates.append(node);
+    }
+  }
+
+  lookups->insert(key.toByteArray(), lookup);
+  if (!lookupTimer->isActive()) {
+    lookupTimer->start(LOOKUPTICK);
+  }
+  advanceLookup(lookup);
+}
+
+void NetSocket::advanceLookup(Lookup *lookup) {
+  while (lookup->inFlight.size() < LOOKUPALPHA &&
+         !lookup->candidates.isEmpty()) {
+    QString node = lookup->candidates.takeFirst();
+    Peer *peer = routingTable->value(node);
+    if (node == originID || peer == NULL ||
+        lookup->queried.contains(node) || suspected->contains(node)) {
+      continue;
+    }
+    lookup->queried.append(node);
+    lookup->inFlight.insert(node, liveClock.elapsed());
+    QVariantMap *msg = new QVariantMap();
+    msg->insert(TYPE, MSG_FINDSUCC);
+    msg->insert(DEST, node);
+    msg->insert(ORIGIN, originID);
+    msg->insert(HOPLIMIT, DEFLIM);
+    msg->insert(FILEHASH, lookup->key.toByteArray());
+    sendMsg(msg, *peer);
+  }
+  if (lookup->inFlight.isEmpty()) {
+    // Nobody left to ask
+    finishLookup(lookup, QString());
+  }
+}
+
+void NetSocket::finishLookup(Lookup *lookup, QString owner) {
+  lookups->remove(lookup->key.toByteArray());
+  if (owner.isEmpty()) {
+    qDebug() << " > lookup of" << lookup->key.toString()
+             << "failed, routing through the finger table";
+    owner = routeTarget(lookup->key);
+  } else {
+    cacheOwner(lookup->key, owner);
+  }
+  QString standIn = standInFor(lookup->key);
+  for (int i = 0; i < lookup->pending.size(); i++) {
+    QVariantMap msg = lookup->pending.at(i);
+    if (!standIn.isEmpty() && owner == standIn) {
+      msg.insert(STANDIN, owner);
+    }
+    sendToNode(&msg, owner);
+  }
+  delete lookup;
+}
+
+void NetSocket::gotCompactTimeout() {
+  chunkStore->compactStep();
+}
+
+void NetSocket::gotLookupTimeout() {
+  qint64 now = liveClock.elapsed();
+  QList<QByteArray> keys = lookups->keys();
+  for (int i = 0; i < keys.size(); i++) {
+    Lookup *lookup = lookups->value(keys.at(i));
+    // Slow hops are left behind rather than waited on
+    QMutableHashIterator<QString, qint64> it(lookup->inFlight);
+    bool expired = false;
+    while (it.hasNext()) {
+      if (now - it.next().value() >= LOOKUPTIMEOUT) {
+        it.remove();
+        expired = true;
+      }
+    }
+    if (expired) {
+      advanceLookup(lookup);
+    }
+  }
+  if (lookups->isEmpty()) {
+    lookupTimer->stop();
+  }
+}
+
+QString NetSocket::routeTarget(RingId hash) {
+  QString cached = cachedOwner(hash);
+  if (!cached.isEmpty()) {
+    return cached;
+  }
+  // Suspects are passed over for nearer fingers; a suspected owner's
+  // first live successor holds its keys until it answers again
+  QString next = fingerTable->getPeerFromHash(hash, *suspected);
+  if (next == fingerTable->ownerOf(hash)) {
+    QString standIn = standInFor(hash);
+    if (!standIn.isEmpty()) {
+      return standIn;
+    }
+  }
+  return next;
+}
+
+QString NetSocket::standInFor(RingId key) {
+  if (!suspected->contains(fingerTable->ownerOf(key))) {
+    return QString();
+  }
+  QStringList successors = fingerTable->replicasOf(key, replicas);
+  for (int i = 0; i < successors.size(); i++) {
+    if (!suspected->contains(successors.at(i))) {
+      return successors.at(i);
+    }
+  }
+  return QString();
 }
 
 bool NetSocket::isTransferRequest(QVariantMap msg) {
@@ -1387,22 +4078,14 @@ bool NetSocket::isTransferRequest(QVariantMap msg) {
 }
 
 void NetSocket::doTransferRequest(QVariantMap msg) {
-  int desiredLoc = (msg[FILEHASH]).toInt();
+  RingId desiredLoc(msg[FILEHASH].toByteArray());
   if (msg.find(REDUNDANT) != msg.end()) {
-    if (msg.value(REDUNDANT).toString() == originID) {
+    if (msg.value(REDUNDANT).toString() == originID &&
+        msg.contains(FRAGMENT)) {
+      storeFragmentCopy(msg);
+    } else if (msg.value(REDUNDANT).toString() == originID) {
       // Accept redundant copy destined for me
-      QString fileName = msg[FILENAME].toString();
-      FileSharing *fileSharing = new FileSharing();
-      Files *file = fileSharing->getFile(fileName);
-      file->filename = removePrefix(file->filename);
-      if (!redundancyArchive->contains(file->filename)) {
-        qDebug() << " storing redundant copy of file" << file->filename;
-        replyToTransferRequest(msg);
-        redundancyArchive->insert(file->filename, *file);
-        printRedundancyArchive();
-      } else {
-        qDebug() << " already own redundant copy of" << file->filename;
-      }
+      ingestFile(msg[FILENAME].toString(), INGEST_REDUNDANT, msg);
     } else {
       // Otherwise send on to destination
       qDebug() << " forwarding on redundant copy to destination:"
@@ -1411,9 +4094,19 @@ void NetSocket::doTransferRequest(QVariantMap msg) {
       sendMsg(&msg, *peer);
     }
   } else if (isMyDHTRequest(desiredLoc)) {
+    Files have = dhtArchive->value(msg[FILENAME].toString());
+    if (!have.blocklist.isEmpty() &&
+        have.blocklistHash == msg[BLOCKLISTHASH].toByteArray()) {
+      // A repeated handoff of a file already fetched
+      sendTransferAck(msg[ORIGIN].toString(), msg[FILENAME].toString());
+      return;
+    }
     // Accept files that hash to this node's interval
     qDebug() << " storing primary copy of file" << msg[FILENAME].toString();
     replyToTransferRequest(msg); 
+  } else if (msg.value(STANDIN).toString() == originID ||
+             standInFor(desiredLoc) == originID) {
+    holdFor(msg, fingerTable->ownerOf(desiredLoc));
   } else {
     // Send other files back through finger table
     qDebug() << " sending transfer through the finger table";
@@ -1421,25 +4114,169 @@ void NetSocket::doTransferRequest(QVariantMap msg) {
   }
 }
 
+void NetSocket::holdFor(QVariantMap msg, QString owner) {
+  QString filename = msg.value(FILENAME).toString().split("/").last();
+  Files have = redundancyArchive->value(filename);
+  if (redundancyArchive->contains(filename) &&
+      (have.blocklist.isEmpty() ||
+       have.blocklistHash == msg.value(BLOCKLISTHASH).toByteArray())) {
+    // Already held, or on its way
+    if (!have.blocklist.isEmpty()) {
+      handoffs->insert(filename, owner);
+    }
+    return;
+  }
+  qDebug() << " holding" << filename << "for" << owner
+           << "while it is not answering";
+  // Served as a redundant copy, and handed over like one being left
+  // behind by an owner, once owner answers again
+  handoffs->insert(filename, owner);
+  msg.insert(REDUNDANT, originID);
+  if (msg.value(ORIGIN).toString() == originID) {
+    ingestFile(msg.value(FILENAME).toString(), INGEST_REDUNDANT, msg);
+  } else {
+    replyToTransferRequest(msg);
+  }
+}
+
 void NetSocket::copyFile(QVariantMap msg) {
   qDebug() << " adding" << msg[FILENAME].toString() << "to files owned"; 
+  ingestFile(msg[FILENAME].toString(), INGEST_OWNED, msg);
+}
+
+void NetSocket::ingestFile(QString path, int purpose, QVariantMap context) {
+  QCA::init();
+  if (!QCA::isSupported("sha1")) {
+    qDebug() << "error: SHA-1 not supported";
+    return;
+  }
+  FileIngest *ingest = new FileIngest(path, purpose, context);
+  connect(ingest, SIGNAL(finished(FileIngest*)),
+          this, SLOT(gotFileIngested(FileIngest*)));
+  ingest->start();
+}
 
-  QString fileName = msg[FILENAME].toString();
+void NetSocket::gotFileIngested(FileIngest *ingest) {
+  if (!ingest->ok) {
+    switch (ingest->purpose) {
+    case INGEST_OWNED:
+      qDebug() << "error: could not hash" << ingest->path
+               << "to take it on as owned";
+      break;
+    case INGEST_REDUNDANT:
+      qDebug() << "error: could not hash" << ingest->path
+               << "to keep it as a redundant copy";
+      break;
+    case INGEST_FRAGMENT: {
+      // The file would otherwise stay marked as being coded, and never
+      // be replicated; send whole copies instead
+      QString filename = ingest->context.value(FILENAME).toString();
+      qDebug() << "error: could not hash parity" << ingest->path
+               << "of" << filename << "- replicating it whole";
+      remove(ingest->path.toStdString().c_str());
+      dropFragments(filename);
+      if (dhtArchive->contains(filename)) {
+        sendWholeCopies(dhtArchive->value(filename));
+      }
+      break;
+    }
+    }
+  } else {
+    Files file = ingest->file;
+    file.filename = removePrefix(file.filename);
+    switch (ingest->purpose) {
+    case INGEST_OWNED:
+      storeOwnedCopy(file);
+      break;
+    case INGEST_REDUNDANT:
+      storeRedundantCopy(ingest->context, file);
+      break;
+    case INGEST_FRAGMENT:
+      // Parity is read back from where it was written
+      file.filename = ingest->path;
+      storeFragment(ingest->context, file);
+      break;
+    }
+  }
+  ingest->deleteLater();
+}
 
-  FileSharing *fileSharing = new FileSharing();
-  Files *file = fileSharing->getFile(fileName);
-  file->filename = removePrefix(file->filename);
-  if (!dhtArchive->contains(file->filename)) {
-    dhtArchive->insert(file->filename, *file);
+void NetSocket::storeOwnedCopy(Files file) {
+  if (!dhtArchive->contains(file.filename)) {
+    archiveFile(DHT_ARCHIVE, file.filename, file);
     printDHTArchive();
-    addToFrontRecentDHT(file->filename);
+    evictionPolicy->insert(file.filename);
+
+    // Send out redundant copies to the file's successors
+    sendReplicas(file);
+  }
+}
+
+void NetSocket::storeRedundantCopy(QVariantMap msg, Files file) {
+  if (!redundancyArchive->contains(file.filename)) {
+    qDebug() << " storing redundant copy of file" << file.filename;
+    replyToTransferRequest(msg);
+    archiveFile(REDUNDANCY_ARCHIVE, file.filename, file);
+    printRedundancyArchive();
+  } else {
+    qDebug() << " already own redundant copy of" << file.filename;
+  }
+}
 
-    // Send out redundant copy to oneBehind
-    msg.insert(REDUNDANT, fingerTable->oneBehind);
-    Peer *peer = routingTable->value(fingerTable->oneBehind);
-    sendMsg(&msg, *peer);
-    qDebug() << "sent out redundant copy to"
-             << fingerTable->oneBehind;
+void NetSocket::storeFragmentCopy(QVariantMap msg) {
+  QString filename = msg.value(FILENAME).toString().split("/").last();
+  if (!isValidFragmentSet(msg)) {
+    qDebug() << "error: refusing malformed fragment set of" << filename;
+    return;
+  }
+  QVariantMap old = fragmentSets->value(filename);
+  // Holders are told again whenever another fragment moves
+  fragmentSets->insert(filename, msg);
+  if (redundancyArchive->contains(filename)) {
+    if (old.value(FRAGMENT) == msg.value(FRAGMENT)) {
+      qDebug() << " > updated holders of fragments of" << filename;
+      return;
+    }
+    evictionPolicy->remove(filename, false);
+    QString fileToDelete = "red_" + filename;
+    remove(fileToDelete.toStdString().c_str());
+    unarchiveFile(REDUNDANCY_ARCHIVE, filename);
+  }
+  qDebug() << " storing fragment" << msg.value(FRAGMENT).toInt()
+           << "of" << filename;
+  replyToTransferRequest(msg);
+}
+
+bool NetSocket::isValidFragmentSet(QVariantMap msg) {
+  int k = msg.value(ERASURE).toInt();
+  int n = msg.value(FRAGMENTS).toList().size();
+  int i = msg.value(FRAGMENT).toInt();
+  qint64 size = msg.value(FILESIZE).toLongLong();
+  if (k < 1 || k >= n || n > MAXFRAGMENTS || i < 0 || i >= n ||
+      msg.value(HOLDERS).toStringList().size() != n) {
+    return false;
+  }
+  // The rebuilt file is held in memory whole
+  return size > 0 && size <= dhtSizeLimit && size <= INT_MAX;
+}
+
+void NetSocket::storeFragment(QVariantMap context, Files file) {
+  QString filename = context.value(FILENAME).toString();
+  if (!encoding->contains(filename)) {
+    // File was dropped while its parity was being hashed
+    remove(file.filename.toStdString().c_str());
+    return;
+  }
+  archiveFile(FRAGMENT_ARCHIVE,
+              fragmentName(filename, context.value(FRAGMENT).toInt()), file);
+  for (int i = 0; i < ecData + ecParity; i++) {
+    if (!fragmentArchive->contains(fragmentName(filename, i))) {
+      return;
+    }
+  }
+  encoding->remove(filename);
+  if (dhtArchive->contains(filename)) {
+    sendFragments(dhtArchive->value(filename));
   }
 }
 
@@ -1473,57 +4310,122 @@ void NetSocket::replyToTransferRequest(QVariantMap msg) {
   QPair<QString, QPair<QByteArray, QString> > fullPair =
     qMakePair(fileName, pair); 
   if (msg.find(REDUNDANT) != msg.end()) {
-    redundancyArchive->insert(fileName.split("/").last(), *file);
+    archiveFile(REDUNDANCY_ARCHIVE, fileName.split("/").last(), *file);
     qDebug() << "ADDED" << fileName.split("/").last() << "to redArch";
     gotReqToDownload(fullPair, false);
   } else {
-    dhtArchive->insert(fileName.split("/").last(), *file);
+    archiveFile(DHT_ARCHIVE, fileName.split("/").last(), *file);
     qDebug() << "ADDED" << fileName.split("/").last() << "to dhtArch";
     gotReqToDownload(fullPair, false);
   }
 }
 
-bool NetSocket::isMyDHTRequest(int desiredLoc) {
-  // Check if desiredLoc is BETWEEN one behind and cur (2 cases)
-  int curHash = fingerTable->curHash;
-  if (curHash == desiredLoc) {
-    return true; 
-  }
-  int oneBehind = fingerTable->getHash(nSpots, fingerTable->oneBehind);
-  qDebug() << " this node's interval:" << oneBehind << "< x <="
-           << curHash;
-  qDebug() << " > file hashes to" << desiredLoc;
-  if (curHash == oneBehind) {
-    return true;
-  } else if (curHash > oneBehind) {
-    if (desiredLoc <= curHash && desiredLoc > oneBehind) {
-      return true;
-    }
-  } else {
-    if (desiredLoc <= curHash || desiredLoc > oneBehind) {
-      return true;
-    }
-  }
-  return false;
+bool NetSocket::isMyDHTRequest(RingId desiredLoc) {
+  // Owned if one of this node's vnodes is desiredLoc's successor
+  QString owner = fingerTable->ownerOf(desiredLoc);
+  qDebug() << " > file hashes to" << desiredLoc.toString()
+           << "owned by" << owner;
+  return owner == originID;
 }
 
 bool NetSocket::haveRedundantCopy(QString filename) {
-  if (redundancyArchive->find(filename) != redundancyArchive->end()) {
+  if (redundancyArchive->find(filename) != redundancyArchive->end() &&
+      !fragmentSets->contains(filename)) {
     return true;
   }
   return false;
 }
 
-bool NetSocket::isDownloading() {
-  return downloading;
+bool NetSocket::isDownloading(QByteArray blocklistHash) {
+  return downloads->contains(blocklistHash);
+}
+
+QStringList NetSocket::holdersOf(QByteArray blocklistHash) {
+  QStringList holders;
+  QList<BlockLocation> locs = blockIndex->value(blocklistHash);
+  for (int i = 0; i < locs.size(); i++) {
+    if (locs.at(i).blockIndex >= 0) {
+      continue;
+    }
+    QStringList others;
+    RingId key = fingerTable->getHash(locs.at(i).filename);
+    if (locs.at(i).archive == DHT_ARCHIVE ||
+        locs.at(i).archive == REDUNDANCY_ARCHIVE) {
+      // Owner and every replica hold a copy, but a fragment holder has
+      // only its own fragment, which the owner also serves
+      others.append(fingerTable->ownerOf(key));
+      bool coded = fragmentSets->contains(locs.at(i).filename);
+      if (locs.at(i).archive == DHT_ARCHIVE) {
+        coded = isErasureCoded(dhtArchive->value(locs.at(i).filename));
+      }
+      if (!coded) {
+        others += fingerTable->replicasOf(key, replicas);
+      }
+    }
+    if (holders.isEmpty()) {
+      holders.append(originID);
+    }
+    for (int j = 0; j < others.size(); j++) {
+      if (!others.at(j).isEmpty() && !holders.contains(others.at(j))) {
+        holders.append(others.at(j));
+      }
+    }
+  }
+  return holders;
+}
+
+QList<DownloadFile*> NetSocket::findDownloads(QByteArray blockReq,
+                                              QString origin) {
+  QList<DownloadFile*> found;
+
+  // A blocklist metafile is keyed directly
+  DownloadFile *d = downloads->value(blockReq);
+  if (d != NULL && d->file->blocklist.isEmpty()) {
+    if (d->sourceIndex(origin) >= 0) {
+      found.append(d);
+    }
+    return found;
+  }
+
+  // Otherwise hand the block to every download from origin that has it
+  QHashIterator<QByteArray, DownloadFile*> it(*downloads);
+  while (it.hasNext()) {
+    d = it.next().value();
+    if (d->sourceIndex(origin) >= 0 &&
+        d->blockPositions->contains(blockReq)) {
+      found.append(d);
+    }
+  }
+  return found;
 }
 
-QByteArray NetSocket::getDfileBlockReq() {
-  return dfile->msg->value(BLOCKREQ).toByteArray();
+void NetSocket::addDownloadSource(DownloadFile *d, QString origin) {
+  if (origin.isEmpty() || origin == originID ||
+      d->sourceIndex(origin) >= 0 || !routingTable->contains(origin)) {
+    return;
+  }
+  qDebug() << " > also downloading" << d->file->filename << "from" << origin;
+  d->sources.append(DownloadSource(origin, *(routingTable->value(origin))));
 }
 
-QString NetSocket::getTargetNode() {
-  return dfile->targetNode;
+void NetSocket::endDownload(DownloadFile *d) {
+  d->retransmit->stop();
+  d->retransmit->deleteLater();
+  downloads->remove(d->file->blocklistHash);
+  // A finished file is accounted for by the archive it goes into
+  reservations->remove(d->file->blocklistHash);
+  if (d->packed) {
+    for (int i = 0; i < d->received.size(); i++) {
+      if (d->received.at(i)) {
+        chunkStore->unref(d->file->blocklist.mid(20*i, 20));
+      }
+    }
+  }
+  // Start on the names that were waiting for these contents
+  for (int i = 0; i < d->queued.size(); i++) {
+    gotReqToDownload(d->queued.at(i).first, d->queued.at(i).second);
+  }
+  d->queued.clear();
 }
 
 void NetSocket::gotReqToDownload(QPair<QString, QPair<QByteArray, QString> > pair,
@@ -1532,9 +4434,21 @@ void NetSocket::gotReqToDownload(QPair<QString, QPair<QByteArray, QString> > pai
     qDebug() << " > invalid target node" << pair.second.second;
     return;
   }
+  DownloadFile *running = downloads->value(pair.second.first);
+  if (running != NULL) {
+    // The same contents under another name (or for the user as well as
+    // the DHT) are fetched once this download is done with them
+    qDebug() << " > already downloading" << pair.second.first.toHex();
+    if (QFileInfo(running->file->filename).fileName() !=
+        downloadName(pair.first, isDownload)) {
+      running->queued.append(qMakePair(pair, isDownload));
+    }
+    return;
+  }
 
   // Form block request message
   QVariantMap *msg = new QVariantMap();
+  msg->insert(TYPE, MSG_BLOCKREQ);
   msg->insert(DEST, pair.second.second);
   msg->insert(BLOCKREQ, pair.second.first);
   msg->insert(ORIGIN, originID);
@@ -1543,138 +4457,262 @@ void NetSocket::gotReqToDownload(QPair<QString, QPair<QByteArray, QString> > pai
   // Find originID in routing table
   Peer *dest = routingTable->value(msg->value(DEST).toString());
 
-  // Send to that peer
-  sendMsg(msg, *dest);
-
   // Note file as awaiting download
-  dfile = new DownloadFile();
+  DownloadFile *dfile = new DownloadFile();
   dfile->targetNode = pair.second.second;
   dfile->blocksDownloaded = 0;
-  dfile->dest = *dest;
+  dfile->sources.append(DownloadSource(dfile->targetNode, *dest));
   dfile->msg = msg;
   dfile->isDownload = isDownload;
   dfile->file = new Files();
+  dfile->file->blocklistHash = pair.second.first;
+  dfile->clock.start();
+  downloads->insert(dfile->file->blocklistHash, dfile);
+
+  // Send to that peer
+  sendBlockReq(dfile, -1, 0);
 
   // Set file name as relative file name
-  QStringList parts = pair.first.split("/");
-  QString prefix = "download_";
-  if (!isDownload) {
-    prefix = "dht_";
-    if (redundancyArchive->contains(parts.last())) {
-      prefix = "red_";
-    }
-  }
-  dfile->file->filename = prefix.append(parts.last());
+  dfile->file->filename = downloadName(pair.first, isDownload);
 
   qDebug() << "AWAITING DOWNLOAD OF" << dfile->file->filename
            << "from" << (*dest).toString();
 
-  // Every 2 seconds, retransmit request
+  // Regularly retransmit requests that have gone unanswered
   dfile->retransmit = new QTimer(this);
   connect(dfile->retransmit, SIGNAL(timeout()),
           this, SLOT(gotRetransmit()));
-  dfile->retransmit->start(2000);
+  dfile->retransmit->start(RETRANSMITTICK);
   return;
 }
 
-void NetSocket::addToFrontRecentDHT(QString filename) {
-  int index = recentDHTFiles->indexOf(filename); 
-  if (index != -1) {
-    recentDHTFiles->remove(index); 
-  } 
-  recentDHTFiles->push_front(filename); 
+QString NetSocket::downloadName(QString filename, bool isDownload) {
+  QString name = filename.split("/").last();
+  QString prefix = "download_";
+  if (!isDownload) {
+    prefix = "dht_";
+    int kind = storeKind(name);
+    if (kind == REDUNDANCY_ARCHIVE) {
+      prefix = "red_";
+    } else if (kind == HOT_ARCHIVE) {
+      prefix = "hot_";
+    }
+  }
+  return prefix.append(name);
+}
 
+int NetSocket::storeKind(QString name) {
+  if (dhtArchive->contains(name)) {
+    return DHT_ARCHIVE;
+  } else if (redundancyArchive->contains(name)) {
+    return REDUNDANCY_ARCHIVE;
+  } else if (hotArchive->contains(name)) {
+    return HOT_ARCHIVE;
+  }
+  return FILE_ARCHIVE;
 }
 
-QByteArray NetSocket::findBlock(QByteArray blockReq) {
-  QMapIterator<QString, Files> it(*dhtArchive);
-  QByteArray *block = new QByteArray();
-  while (it.hasNext()) {
-    Files file = it.next().value();
-    // Return blocklist metafile if given a blocklistHash
-    // asking for a file 
-    if (file.blocklistHash == blockReq) {
-      *block = QByteArray(file.blocklist);
-      return *block;
+void NetSocket::sendBlockReq(DownloadFile *d, qint64 block, int src) {
+  QByteArray blockReq = d->file->blocklistHash;
+  if (block >= 0) {
+    blockReq = d->file->blocklist.mid(20*block, 20);
+  }
+  DownloadSource &source = d->sources[src];
+  d->msg->insert(DEST, source.originID);
+  d->msg->insert(BLOCKREQ, blockReq);
+  sendMsg(d->msg, source.peer);
+  d->outstanding->insert(block, qMakePair(d->clock.elapsed(), src));
+  source.inFlight++;
+}
+
+int NetSocket::pickSource(DownloadFile *d) {
+  int best = -1;
+  qint64 bestWait = 0;
+  for (int i = 0; i < d->sources.size(); i++) {
+    DownloadSource src = d->sources.at(i);
+    if (src.failed || src.inFlight >= src.window) {
+      continue;
     }
-    // Return block of data if given a blocklist metafile chunk
-    for (qint64 i = 1; i <= file.filesize; i++) {
-      qint64 blockIndex = (i-1) * 20;
-      /*
-        qDebug() << "looking for " << blockReq.toHex() << " and is at index "
-        << file.blocklist.indexOf(blockReq, blockIndex) << " of blockList";
-      */
-      if (file.blocklist.indexOf(blockReq, blockIndex) == blockIndex) {
-        QFile readF(file.filename);
-        readF.open(QIODevice::ReadOnly);
-        if (!readF.seek((i-1)*MAXBYTES)) {
-          qDebug() << "error reading from" << file.filename;
-        }
-        *block = readF.read(MAXBYTES);
-        // qDebug() << originID << "found data block" << i-1;
-        return *block;
-      }
+    // Expected wait for one more request: a source answers about window
+    // requests per round trip
+    qint64 rtt = src.srtt < 0 ? RETRANSMIT / 4 : src.srtt;
+    qint64 wait = (src.inFlight + 1) * rtt / src.window;
+    if (best < 0 || wait < bestWait) {
+      best = i;
+      bestWait = wait;
     }
   }
-  it = QMapIterator<QString, Files>(*redundancyArchive);
-  while (it.hasNext()) {
-    Files file = it.next().value();
-    // Return blocklist metafile if given a blocklistHash
-    // asking for a file 
-    if (file.blocklistHash == blockReq) {
-      *block = QByteArray(file.blocklist);
-      return *block;
+  return best;
+}
+
+void NetSocket::fillWindow(DownloadFile *d) {
+  while (true) {
+    // Blocks identical to an earlier one may already have been written
+    while (!d->pending->isEmpty() && d->received.at(d->pending->first())) {
+      d->pending->removeFirst();
     }
-    // Return block of data if given a blocklist metafile chunk
-    for (qint64 i = 1; i <= file.filesize; i++) {
-      qint64 blockIndex = (i-1) * 20;
-      /*
-        qDebug() << "looking for " << blockReq.toHex() << " and is at index "
-        << file.blocklist.indexOf(blockReq, blockIndex) << " of blockList";
-      */
-      if (file.blocklist.indexOf(blockReq, blockIndex) == blockIndex) {
-        QFile readF(file.filename);
-        readF.open(QIODevice::ReadOnly);
-        if (!readF.seek((i-1)*MAXBYTES)) {
-          qDebug() << "error reading from" << file.filename;
-        }
-        *block = readF.read(MAXBYTES);
-        // qDebug() << originID << "found data block" << i-1;
-        return *block;
-      }
+    while (d->pending->isEmpty() && d->nextBlock < d->file->filesize &&
+           d->received.at(d->nextBlock)) {
+      d->nextBlock++;
+    }
+    if (d->pending->isEmpty() && d->nextBlock >= d->file->filesize) {
+      return;
+    }
+
+    int src = pickSource(d);
+    if (src < 0) {
+      return;
+    }
+    if (!d->pending->isEmpty()) {
+      sendBlockReq(d, d->pending->takeFirst(), src);
+    } else {
+      sendBlockReq(d, d->nextBlock++, src);
     }
   }
-  it = QMapIterator<QString, Files>(*fileArchive);
-  while (it.hasNext()) {
-    Files file = it.next().value();
+}
+
+QByteArray NetSocket::findBlock(QByteArray blockReq) {
+  QByteArray block;
+  QHash<QByteArray, QList<BlockLocation> >::const_iterator it =
+    blockIndex->constFind(blockReq);
+  if (it == blockIndex->constEnd() || it.value().isEmpty()) {
+    //  qDebug() << originID << "did not find blockReq"; // DEBUG
+    return block;
+  }
+
+  // Locations are ordered by archive, so the first one is the one the
+  // archives would have been searched in
+  BlockLocation loc = it.value().first();
+  Files file = getArchive(loc.archive)->value(loc.filename);
+  if (loc.blockIndex < 0) {
     // Return blocklist metafile if given a blocklistHash
     // asking for a file 
-    if (file.blocklistHash == blockReq) {
-      *block = QByteArray(file.blocklist);
-      return *block;
+    return file.blocklist;
+  }
+
+  // Return block of data if given a blocklist metafile chunk
+  if (file.packed) {
+    return chunkStore->read(blockReq);
+  }
+  QFile readF(file.filename);
+  readF.open(QIODevice::ReadOnly);
+  if (!readF.seek(loc.blockIndex*MAXBYTES)) {
+    qDebug() << "error reading from" << file.filename;
+  }
+  block = readF.read(MAXBYTES);
+  // qDebug() << originID << "found data block" << loc.blockIndex;
+  return block;
+}
+
+QMap<QString, Files>* NetSocket::getArchive(int archive) {
+  switch (archive) {
+  case DHT_ARCHIVE:
+    return dhtArchive;
+  case REDUNDANCY_ARCHIVE:
+    return redundancyArchive;
+  case FRAGMENT_ARCHIVE:
+    return fragmentArchive;
+  case HOT_ARCHIVE:
+    return hotArchive;
+  default:
+    return fileArchive;
+  }
+}
+
+void NetSocket::archiveFile(int archive, QString key, Files file) {
+  QMap<QString, Files> *map = getArchive(archive);
+  bool replaced = map->contains(key);
+  if (replaced) {
+    Files old = map->value(key);
+    unindexFile(archive, key, old);
+    (*archiveBytes)[archive] -= old.filesize;
+    if (old.packed) {
+      chunkStore->unrefAll(old.blocklist);
     }
-    // Return block of data if given a blocklist metafile chunk
-    for (qint64 i = 1; i <= file.filesize; i++) {
-      qint64 blockIndex = (i-1) * 20;
-      /*
-        qDebug() << "looking for " << blockReq.toHex() << " and is at index "
-        << file.blocklist.indexOf(blockReq, blockIndex) << " of blockList";
-      */
-      if (file.blocklist.indexOf(blockReq, blockIndex) == blockIndex) {
-        QFile readF(file.filename);
-        readF.open(QIODevice::ReadOnly);
-        if (!readF.seek((i-1)*MAXBYTES)) {
-          qDebug() << "error reading from" << file.filename;
-        }
-        *block = readF.read(MAXBYTES);
-        // qDebug() << originID << "found data block" << i-1;
-        return *block;
-      }
+  }
+  map->insert(key, file);
+  indexFile(archive, key, file);
+  (*archiveBytes)[archive] += file.filesize;
+  if (file.packed) {
+    chunkStore->refAll(file.blocklist);
+  }
+  if (isIndexed(archive, key, file)) {
+    logStore(STORE_PUT, archive, key, file);
+  } else if (replaced) {
+    logStore(STORE_DELETE, archive, key, Files());
+  }
+  if (archive == DHT_ARCHIVE) {
+    RingId ringKey = fingerTable->getHash(key);
+    ownedKeys->remove(ringKey, key);
+    ownedKeys->insert(ringKey, key);
+  }
+}
+
+void NetSocket::unarchiveFile(int archive, QString key) {
+  QMap<QString, Files> *map = getArchive(archive);
+  if (map->contains(key)) {
+    Files file = map->take(key);
+    unindexFile(archive, key, file);
+    (*archiveBytes)[archive] -= file.filesize;
+    if (file.packed) {
+      // The blocks go once compaction gets to them
+      chunkStore->unrefAll(file.blocklist);
+    }
+    if (archive != FRAGMENT_ARCHIVE) {
+      logStore(STORE_DELETE, archive, key, Files());
     }
   }
+  if (archive == DHT_ARCHIVE) {
+    ownedKeys->remove(fingerTable->getHash(key), key);
+  }
+}
+
+void NetSocket::indexFile(int archive, QString key, Files file) {
+  QList<QPair<QByteArray, qint64> > entries;
+  if (!file.blocklistHash.isEmpty()) {
+    entries.append(qMakePair(file.blocklistHash, (qint64) -1));
+  }
+  for (qint64 i = 0; i < file.blocklist.size() / 20; i++) {
+    entries.append(qMakePair(file.blocklist.mid(i*20, 20), i));
+  }
+
+  for (int i = 0; i < entries.size(); i++) {
+    QList<BlockLocation> &locs = (*blockIndex)[entries.at(i).first];
+    // Keep locations sorted by archive so lookups take the first one
+    int pos = 0;
+    while (pos < locs.size() && locs.at(pos).archive <= archive) {
+      pos++;
+    }
+    locs.insert(pos, BlockLocation(archive, key, entries.at(i).second));
+  }
+}
+
+void NetSocket::unindexFile(int archive, QString key, Files file) {
+  QList<QByteArray> hashes;
+  if (!file.blocklistHash.isEmpty()) {
+    hashes.append(file.blocklistHash);
+  }
+  for (qint64 i = 0; i < file.blocklist.size() / 20; i++) {
+    hashes.append(file.blocklist.mid(i*20, 20));
+  }
 
-  //  qDebug() << originID << "did not find blockReq"; // DEBUG
-  return *block;
+  for (int i = 0; i < hashes.size(); i++) {
+    QHash<QByteArray, QList<BlockLocation> >::iterator it =
+      blockIndex->find(hashes.at(i));
+    if (it == blockIndex->end()) {
+      continue;
+    }
+    QMutableListIterator<BlockLocation> lit(it.value());
+    while (lit.hasNext()) {
+      BlockLocation loc = lit.next();
+      if (loc.archive == archive && loc.filename == key) {
+        lit.remove();
+      }
+    }
+    if (it.value().isEmpty()) {
+      blockIndex->erase(it);
+    }
+  }
 }
 
 QString NetSocket::removePrefix(QString withPrefix) {
@@ -1684,132 +4722,254 @@ QString NetSocket::removePrefix(QString withPrefix) {
     return withPrefix.remove("dht_");
   } else if (withPrefix.startsWith("red_")) {
     return withPrefix.remove("red_");
+  } else if (withPrefix.startsWith("hot_")) {
+    return withPrefix.remove("hot_");
   }
   return withPrefix;
 }
 
-void NetSocket::removeLastDHTFile() {
-  if (recentDHTFiles->size() == 0) {
-    return; 
-  }
+void NetSocket::evictDHTFile(QString toRemove) {
   //printRecentDHTFiles(); 
 
-  qDebug() << "used up" << dhtCurrentSize << "of" << dhtSizeLimit << "kb";
-	
-  int toRemoveSizeKb;
-  QString toRemove = recentDHTFiles->at(recentDHTFiles->size() - 1);
-  qDebug() << " > removing least recently used item:" << toRemove;
-  if (dhtArchive->find(toRemove) != dhtArchive->end()) {
-    toRemoveSizeKb = ((*dhtArchive)[toRemove].blocklist.size()/20 + 1) * 8; 
+  qDebug() << " >" << evictionPolicy->name() << "evicting" << toRemove;
+  dropCopy(toRemove);
+  evictionPolicy->remove(toRemove, true);
+  evictionPolicy->evictions++;
+
+  qDebug() << " > new amount of memory used:"
+           << formatSize(usedBytes(DHT_ARCHIVE));
+  printEvictionStats();
+}
+
+void NetSocket::printEvictionStats() {
+  qDebug() << " >" << evictionPolicy->name() << "hit ratio"
+           << evictionPolicy->hitRatio() << "over"
+           << evictionPolicy->hits + evictionPolicy->misses << "searches,"
+           << evictionPolicy->evictions << "evictions,"
+           << evictionPolicy->rejections << "files turned away";
+}
+
+bool NetSocket::setEvictionPolicy(QString name) {
+  EvictionPolicy *policy = EvictionPolicy::create(name);
+  if (policy == NULL) {
+    return false;
+  }
+  // Hand over stored files, the next victim first
+  QStringList files = evictionPolicy->toList();
+  for (int i = files.size() - 1; i >= 0; i--) {
+    policy->insert(files.at(i));
+  }
+  delete evictionPolicy;
+  evictionPolicy = policy;
+  return true;
+}
+
+void NetSocket::dropCopy(QString filename) {
+  QHashIterator<QByteArray, DownloadFile*> it(*downloads);
+  while (it.hasNext()) {
+    DownloadFile *d = it.next().value();
+    if (!d->isDownload &&
+        removePrefix(QFileInfo(d->file->filename).fileName()) == filename) {
+      endDownload(d);
+    }
+  }
+  if (dhtArchive->find(filename) != dhtArchive->end()) {
     // remove from DHTArchive 
-    dhtArchive->remove(toRemove); 
-    // qDebug() << "removed file from dhtArchive"; 
-    
+    unarchiveFile(DHT_ARCHIVE, filename); 
+    dropFragments(filename);
     // remove file from local storage 
-    QString fileToDelete = "dht_" + toRemove;
+    QString fileToDelete = "dht_" + filename;
     remove(fileToDelete.toStdString().c_str());
-    // qDebug() <<"removed from local storage"; 
   } else {
-    toRemoveSizeKb =
-      ((*redundancyArchive)[toRemove].blocklist.size()/20 + 1) * 8;
     // remove from redundancy archive
-    redundancyArchive->remove(toRemove);
+    unarchiveFile(REDUNDANCY_ARCHIVE, filename);
+    fragmentSets->remove(filename);
     // remove file from local storage 
-    QString fileToDelete = "red_" + toRemove;
+    QString fileToDelete = "red_" + filename;
     remove(fileToDelete.toStdString().c_str());
-    // qDebug() <<"removed from local storage"; 
-
   }
-  // qDebug() << "size in bytes = " << toRemoveSizeKb; 
-  // qDebug() << "to remove is " << toRemove; 
-
-  // remove from recentDHTFiles 
-  recentDHTFiles->remove(recentDHTFiles->indexOf(toRemove)); 
-  // qDebug() << "removed file from recentDHTFiles"; 
-
-  dhtCurrentSize -= toRemoveSizeKb;
-  qDebug() << " > new amount of memory used:" << dhtCurrentSize;
 }
 
-void NetSocket::processBlockReply(QByteArray data) {
-  dfile->retransmit->stop();
+void NetSocket::processBlockReply(DownloadFile *d, QString origin,
+                                  QByteArray blockReq, QByteArray data) {
+  // Settle the requests this reply answers, timing the round trip if
+  // origin is the source they were sent to
+  int src = d->sourceIndex(origin);
+  QList<qint64> positions;
+  if (d->file->blocklist.isEmpty()) {
+    positions.append(-1);
+  } else {
+    positions = d->blockPositions->value(blockReq);
+  }
+  for (int i = 0; i < positions.size(); i++) {
+    if (!d->outstanding->contains(positions.at(i))) {
+      continue;
+    }
+    QPair<qint64, int> sent = d->outstanding->take(positions.at(i));
+    d->sources[sent.second].inFlight--;
+    if (sent.second == src) {
+      qint64 rtt = d->clock.elapsed() - sent.first;
+      qint64 srtt = d->sources.at(src).srtt;
+      d->sources[src].srtt = srtt < 0 ? rtt : (7*srtt + rtt) / 8;
+    }
+  }
+  // A source that answers is alive, and may be sent more at once
+  if (src >= 0) {
+    DownloadSource &source = d->sources[src];
+    source.timeouts = 0;
+    source.failed = false;
+    if (source.window < MAXWINDOW) {
+      source.window++;
+    }
+  }
 
-  if (dfile->file->blocklist.isEmpty()) {
-    int fileSize = data.size()/20 * 8;  
+  if (d->file->blocklist.isEmpty()) {
+    // Only the last block can be short, so this bounds the file's size
+    qint64 fileSize = data.size()/20 * MAXBYTES;
+    QString name = removePrefix(QFileInfo(d->file->filename).fileName());
+    // Archive the copy goes into; the user's own downloads, and fragments
+    // gathered for a rebuild, are not part of the store, even of a file
+    // this node stores under the same name
+    int kind = FILE_ARCHIVE;
+    if (!d->isDownload) {
+      kind = storeKind(name);
+    }
 
-    if (fileSize > dhtSizeLimit) {
-      // Cannot add, b/c size too large. 
-      qDebug() << " cannot import" << dfile->file->filename
-               << "because file size is" << fileSize
-               << "and size limit is" << dhtSizeLimit; 
-      dfile = new DownloadFile(); 
-      return; 
-    } else if ((fileSize + dhtCurrentSize) <= dhtSizeLimit) {
-      // can add w/o deleting 
-      dhtCurrentSize += fileSize; 
-      qDebug() << " currently using" << dhtCurrentSize
-               << "of" << dhtSizeLimit << "kb";
-    } else {	// add and delete 
-      qDebug() << " need to delete other file before adding";
-      while ((fileSize + dhtCurrentSize) > dhtSizeLimit) {
-        removeLastDHTFile(); 
+    // Set space aside for copies kept for the DHT before fetching them
+    if (kind != FILE_ARCHIVE &&
+        !reserveSpace(name, fileSize, kind, d->file->blocklistHash)) {
+      qDebug() << " cannot import" << d->file->filename << "of up to"
+               << formatSize(fileSize);
+      endDownload(d);
+      // The placeholder would otherwise stay, never to be filled, and
+      // searches would be answered with it
+      unarchiveFile(kind, name);
+      if (kind == REDUNDANCY_ARCHIVE) {
+        handoffs->remove(name);
+        fragmentSets->remove(name);
       }
+      return; 
     }
     // Save blocklist metadata
-    dfile->file->blocklist = data;
+    data.detach();
+    d->file->blocklist = data;
     // Set filesize
-    dfile->file->filesize = data.size() / 20;
+    d->file->filesize = data.size() / 20;
+    // Note where each block goes, so replies can arrive in any order
+    for (qint64 i = 0; i < d->file->filesize; i++) {
+      (*(d->blockPositions))[data.mid(20*i, 20)].append(i);
+    }
+    d->received.fill(false, d->file->filesize);
+
+    // Whole copies kept for the DHT go into the chunk store; fragments
+    // are read back from files of their own when rebuilding
+    d->packed = kind == HOT_ARCHIVE ||
+      ((kind == DHT_ARCHIVE || kind == REDUNDANCY_ARCHIVE) &&
+       !fragmentSets->contains(name));
+    if (d->packed) {
+      qDebug() << "SAVING FILE" << name << "TO THE CHUNK STORE";
+    } else {
+      qDebug() << "SAVING FILE AS" << d->file->filename;
+      d->writeFile = new QFile(d->file->filename);
+      d->writeFile->open(QIODevice::WriteOnly);
+    }
   } else {
-    // Write block to file
-    if (dfile->blocksDownloaded == 0) {
-      qDebug() << "SAVING FILE AS" << dfile->file->filename;
-      dfile->writeFile = new QFile(dfile->file->filename);
-      dfile->writeFile->open(QIODevice::WriteOnly);
+    // Write block to every position it occupies in the file
+    for (int i = 0; i < positions.size(); i++) {
+      qint64 block = positions.at(i);
+      if (d->received.at(block)) {
+        continue;
+      }
+      if (d->packed) {
+        // The download holds the block until its archive entry does
+        if (!chunkStore->write(blockReq, data)) {
+          continue;
+        }
+        chunkStore->ref(blockReq);
+      } else {
+        d->writeFile->seek(block*MAXBYTES);
+        d->writeFile->write(data);
+      }
+      d->bytesReceived += data.size();
+      d->received[block] = true;
+      // Update count of blocks downloaded
+      d->blocksDownloaded += 1;
     }
-    dfile->writeFile->write(data);
-    // Update count of blocks downloaded
-    dfile->blocksDownloaded += 1;
   }
 
-  if (dfile->blocksDownloaded == dfile->file->filesize) {
+  if (d->blocksDownloaded == d->file->filesize) {
     // Indicate has finished downloading, and close file
-    downloading = false;
+    endDownload(d);
 
-    dfile->writeFile->close();
-    qDebug() << "FINISHED WRITING" << dfile->file->filename << "to dir";
+    if (d->writeFile != NULL) {
+      d->writeFile->close();
+    }
+    qDebug() << "FINISHED WRITING" << d->file->filename << "to dir";
+    // Every block was checked against the blocklist on arrival, so the
+    // file needs no rehashing
     FileSharing *fileSharing = new FileSharing();
-    Files *file = fileSharing->getFile(dfile->file->filename);
-    file->filename = removePrefix(file->filename);
-    if (dhtArchive->contains(file->filename)) {
-      dhtArchive->insert(file->filename, *file);
+    Files *file = new Files();
+    file->filename = removePrefix(QFileInfo(d->file->filename).fileName());
+    file->blocklist = d->file->blocklist;
+    file->blocklistHash = d->file->blocklistHash;
+    file->filesize = d->bytesReceived;
+    file->packed = d->packed;
+    int kind = storeKind(file->filename);
+    if (fragmentDownloads->contains(file->blocklistHash)) {
+      // Fragments are fetched as downloads, so come before those
+      QPair<QString, int> frag = fragmentDownloads->take(file->blocklistHash);
+      if (rebuilds->contains(frag.first)) {
+        (*rebuilds)[frag.first].insert(frag.second, d->file->filename);
+        finishRebuild(frag.first);
+      }
+    } else if (d->isDownload) {
+      // The user's copy stays as written, even of a file this node also
+      // keeps for the DHT under the same name
+    } else if (kind == DHT_ARCHIVE) {
+      archiveFile(DHT_ARCHIVE, file->filename, *file);
       printDHTArchive();
-      // Initiate redundant copies
-      fileSharing->files.push_back(*file);
-      sendRedundancies(fileSharing);
-      addToFrontRecentDHT(file->filename);
-    } else if (redundancyArchive->contains(file->filename)) {
-      redundancyArchive->insert(file->filename, *file);
+      evictionPolicy->insert(file->filename);
+      // Let a node handing this file over know it can let go
+      sendTransferAck(d->targetNode, file->filename);
+      RingId key = fingerTable->getHash(file->filename);
+      if (!isMyDHTRequest(key)) {
+        // Its key moved on while it was downloading
+        handOff(file->filename, fingerTable->ownerOf(key));
+      } else {
+        // Initiate redundant copies
+        fileSharing->files.push_back(*file);
+        sendRedundancies(fileSharing);
+      }
+    } else if (kind == REDUNDANCY_ARCHIVE) {
+      QString key = file->filename;
+      if (fragmentSets->contains(key)) {
+        // A fragment can only be read back from this node's own copy
+        file->filename = d->file->filename;
+      }
+      archiveFile(REDUNDANCY_ARCHIVE, key, *file);
       printRedundancyArchive();
-      addToFrontRecentDHT(file->filename);
+      evictionPolicy->insert(key);
+      // Held for an owner that the sender, but not this node, suspected
+      QString owner = handoffs->value(key);
+      if (!owner.isEmpty() && !suspected->contains(owner)) {
+        offerFile(key, owner, file->blocklistHash);
+      }
+    } else if (kind == HOT_ARCHIVE) {
+      QString key = file->filename;
+      file->filename = d->file->filename;
+      archiveFile(HOT_ARCHIVE, key, *file);
+      touchHotCopy(key);
+      qDebug() << originID << "cached hot file" << key;
     }
   } else {
-    // Form and send next block request
-    dfile->msg->remove(BLOCKREQ);
-    QByteArray *newBlockReq = new QByteArray();
-    for (int i = 0; i < 20; i++) {
-      newBlockReq->append(dfile->file->blocklist.
-                          at(20*(dfile->blocksDownloaded)+i));
-    }
-    dfile->msg->insert(BLOCKREQ, *newBlockReq);
-
-    sendMsg(dfile->msg, dfile->dest);
-
-    dfile->retransmit->start(2000);
+    // Keep every source's window of block requests full
+    fillWindow(d);
   }
 }
 
 void NetSocket::processSearchReq(QVariantMap msg, Peer p) {
   QVariantMap *rep = new QVariantMap();
+  rep->insert(TYPE, MSG_SEARCHREPLY);
   rep->insert(DEST, msg.value(ORIGIN));
   rep->insert(ORIGIN, originID);
   rep->insert(HOPLIMIT, DEFLIM);
@@ -1830,7 +4990,8 @@ void NetSocket::processSearchReq(QVariantMap msg, Peer p) {
     QStringListIterator lit(strings);
     while (lit.hasNext()) {
       if (filename.contains(lit.next(), Qt::CaseInsensitive)) {
-        addToFrontRecentDHT(filename); 
+        evictionPolicy->touch(filename);
+        logStore(STORE_TOUCH, DHT_ARCHIVE, filename, Files());
         names->push_back(it.value().filename);
         ids->push_back(it.value().blocklistHash);
         break;
@@ -1841,30 +5002,368 @@ void NetSocket::processSearchReq(QVariantMap msg, Peer p) {
   QMapIterator<QString, Files> rit(*redundancyArchive);
   while (rit.hasNext()) {
     QString filename = rit.next().key();
+    if (fragmentSets->contains(filename)) {
+      // A fragment is no use to a searcher
+      continue;
+    }
 
     QStringListIterator lit(strings);
     while (lit.hasNext()) {
       if (filename.contains(lit.next(), Qt::CaseInsensitive)) {
-        addToFrontRecentDHT(filename); 
+        evictionPolicy->touch(filename);
+        logStore(STORE_TOUCH, REDUNDANCY_ARCHIVE, filename, Files());
         names->push_back(rit.value().filename);
         ids->push_back(rit.value().blocklistHash);
         break;
       }
     }
   }
-  // Send back search reply
-  rep->insert(MATCHNAMES, *names);
-  rep->insert(MATCHIDS, *ids);
-  sendMsg(rep, p);
-  return;
+  // Search in hotArchive
+  QMapIterator<QString, Files> hit(*hotArchive);
+  while (hit.hasNext()) {
+    QString filename = hit.next().key();
+    if (hit.value().blocklistHash.isEmpty()) {
+      // Still being fetched
+      continue;
+    }
+
+    QStringListIterator lit(strings);
+    while (lit.hasNext()) {
+      if (filename.contains(lit.next(), Qt::CaseInsensitive)) {
+        touchHotCopy(filename);
+        names->push_back(filename);
+        ids->push_back(hit.value().blocklistHash);
+        break;
+      }
+    }
+  }
+  // Send back search reply
+  rep->insert(MATCHNAMES, *names);
+  rep->insert(MATCHIDS, *ids);
+  sendMsg(rep, p);
+  return;
+}
+
+void NetSocket::gotStartSearchFor(QPair<QString, quint32> pair) {
+  QVariantMap *msg = new QVariantMap();
+  msg->insert(TYPE, MSG_SEARCH);
+  msg->insert(ORIGIN, originID);
+  msg->insert(SEARCH, pair.first);
+  msg->insert(BUDGET, pair.second);
+  // Go straight to the node that answered last time, if still trusted
+  Peer *owner = routingTable->value(
+    cachedOwner(fingerTable->getHash(pair.first)));
+  if (owner != NULL) {
+    sendMsg(msg, *owner);
+    return;
+  }
+  sendByBudget(*msg);
+}
+
+QString NetSocket::cachedOwner(RingId key) {
+  QHash<QByteArray, QPair<QString, qint64> >::iterator it =
+    ownerCache->find(key.toByteArray());
+  if (it == ownerCache->end()) {
+    return QString();
+  }
+  if (it.value().second < liveClock.elapsed() ||
+      suspected->contains(it.value().first)) {
+    ownerCache->erase(it);
+    return QString();
+  }
+  return it.value().first;
+}
+
+void NetSocket::cacheOwner(RingId key, QString owner) {
+  if (owner == originID) {
+    return;
+  }
+  // Keys come from whatever gets searched for, so don't let them pile up
+  if (ownerCache->size() >= OWNERCACHEMAX) {
+    ownerCache->clear();
+  }
+  ownerCache->insert(key.toByteArray(),
+                     qMakePair(owner, liveClock.elapsed() + OWNERCACHETTL));
+}
+
+void NetSocket::noteRelay(QString filename) {
+  qint64 now = liveClock.elapsed();
+  if (now - relayWindowStart >= HOTWINDOW) {
+    relayCounts->clear();
+    relayWindowStart = now;
+    // Searches or replies lost on the way are given up on
+    QMutableHashIterator<QString, qint64> it(*hotPending);
+    while (it.hasNext()) {
+      if (now - it.next().value() >= HOTWINDOW) {
+        it.remove();
+      }
+    }
+  }
+  int count = relayCounts->value(filename, 0) + 1;
+  relayCounts->insert(filename, count);
+  if (count < HOTRELAYS || haveHotCopy(filename) ||
+      (hotPending->contains(filename) &&
+       now - hotPending->value(filename) < HOTWINDOW)) {
+    return;
+  }
+
+  // Ask the owner for the blocklist hash, then fetch the file like any
+  // other download
+  Peer *peer = routingTable->value(
+    routeTarget(fingerTable->getHash(filename)));
+  if (peer == NULL) {
+    return;
+  }
+  QVariantMap *msg = new QVariantMap();
+  msg->insert(TYPE, MSG_SEARCH);
+  msg->insert(ORIGIN, originID);
+  msg->insert(SEARCH, filename);
+  msg->insert(BUDGET, 1);
+  hotPending->insert(filename, now);
+  sendMsg(msg, *peer);
+  qDebug() << originID << "caching hot file" << filename;
+}
+
+void NetSocket::fetchHotCopy(QVariantMap msg) {
+  QString filename = msg.value(SEARCHREP).toString();
+  hotPending->remove(filename);
+
+  QVariantList names = msg.value(MATCHNAMES).toList();
+  QVariantList ids = msg.value(MATCHIDS).toList();
+  for (int i = 0; i < names.size() && i < ids.size(); i++) {
+    if (names.at(i).toString() != filename) {
+      continue;
+    }
+    QByteArray blocklistHash = ids.at(i).toByteArray();
+    if (isDownloading(blocklistHash) ||
+        !routingTable->contains(msg.value(ORIGIN).toString())) {
+      return;
+    }
+    // Placeholder so the download is named and archived as a hot copy
+    archiveFile(HOT_ARCHIVE, filename, Files());
+    gotReqToDownload(qMakePair(filename,
+                               qMakePair(blocklistHash,
+                                         msg.value(ORIGIN).toString())),
+                     false);
+    return;
+  }
+}
+
+bool NetSocket::haveHotCopy(QString filename) {
+  return hotArchive->contains(filename) &&
+    !hotArchive->value(filename).blocklistHash.isEmpty();
+}
+
+void NetSocket::touchHotCopy(QString filename) {
+  hotOrder->touch(filename);
+  logStore(STORE_TOUCH, HOT_ARCHIVE, filename, Files());
+}
+
+void NetSocket::loadStore(StoreIndex *index, QList<StoreRecord> records) {
+  // The latest record of each entry wins, and puts and touches give the
+  // order entries were last used in
+  QHash<QString, StoreRecord> live;
+  RecencyList order;
+  for (int i = 0; i < records.size(); i++) {
+    StoreRecord r = records.at(i);
+    QString entry = QString::number(r.archive) + ":" + r.key;
+    switch (r.op) {
+    case STORE_PUT:
+      live.insert(entry, r);
+      order.touch(entry);
+      break;
+    case STORE_DELETE:
+      live.remove(entry);
+      order.remove(entry);
+      break;
+    case STORE_TOUCH:
+      if (live.contains(entry)) {
+        order.touch(entry);
+      }
+      break;
+    }
+  }
+
+  // Least recently used first, so eviction order comes back as it was
+  QStringList entries = order.toList();
+  int restored = 0;
+  for (int i = entries.size() - 1; i >= 0; i--) {
+    StoreRecord r = live.value(entries.at(i));
+    QFileInfo info(r.file.filename);
+    bool onDisk = r.file.packed ?
+      chunkStore->containsAll(r.file.blocklist) :
+      info.exists() && info.size() == r.file.filesize;
+    if (!isIndexed(r.archive, r.key, r.file) || !onDisk) {
+      qDebug() << " > dropping" << r.key << "from the store index";
+      continue;
+    }
+    archiveFile(r.archive, r.key, r.file);
+    if (r.archive == DHT_ARCHIVE || r.archive == REDUNDANCY_ARCHIVE) {
+      evictionPolicy->insert(r.key);
+    } else if (r.archive == HOT_ARCHIVE) {
+      hotOrder->touch(r.key);
+    }
+    restored++;
+  }
+  qDebug() << originID << "restored" << restored << "files from"
+           << records.size() << "index records";
+
+  storeIndex = index;
+  compactStore();
+}
+
+bool NetSocket::isIndexed(int archive, QString key, Files file) {
+  if (file.blocklist.isEmpty()) {
+    // Downloads under way are started afresh
+    return false;
+  }
+  switch (archive) {
+  case DHT_ARCHIVE:
+  case FILE_ARCHIVE:
+  case HOT_ARCHIVE:
+    return true;
+  case REDUNDANCY_ARCHIVE:
+    return !fragmentSets->contains(key);
+  default:
+    // Owners code their fragments afresh
+    return false;
+  }
+}
+
+void NetSocket::logStore(int op, int archive, QString key, Files file) {
+  if (storeIndex == NULL) {
+    return;
+  }
+  storeIndex->append(StoreRecord(op, archive, key, file));
+  int live = dhtArchive->size() + redundancyArchive->size() +
+    fileArchive->size() + hotArchive->size();
+  if (storeIndex->appended > INDEXCOMPACT &&
+      storeIndex->appended > 4 * live) {
+    compactStore();
+  }
+}
+
+void NetSocket::logOrigin() {
+  if (storeIndex == NULL) {
+    return;
+  }
+  StoreRecord r(STORE_ORIGIN, DHT_ARCHIVE, originID, Files());
+  r.seqNo = seqNo;
+  r.dhtSeqNo = dhtSeqNo;
+  storeIndex->append(r);
+}
+
+void NetSocket::compactStore() {
+  QList<StoreRecord> records;
+  StoreRecord origin(STORE_ORIGIN, DHT_ARCHIVE, originID, Files());
+  origin.seqNo = seqNo;
+  origin.dhtSeqNo = dhtSeqNo;
+  records.append(origin);
+
+  // Owned and redundant files the eviction policy does not order come
+  // first, then the rest with the next victim first, so that replaying
+  // the index gives the same order
+  QStringList used = evictionPolicy->toList();
+  QSet<QString> ordered;
+  for (int i = 0; i < used.size(); i++) {
+    ordered.insert(used.at(i));
+  }
+  QList<int> kinds;
+  kinds << DHT_ARCHIVE << REDUNDANCY_ARCHIVE << FILE_ARCHIVE;
+  for (int k = 0; k < kinds.size(); k++) {
+    QMapIterator<QString, Files> it(*getArchive(kinds.at(k)));
+    while (it.hasNext()) {
+      it.next();
+      if (!ordered.contains(it.key()) &&
+          isIndexed(kinds.at(k), it.key(), it.value())) {
+        records.append(StoreRecord(STORE_PUT, kinds.at(k), it.key(),
+                                   it.value()));
+      }
+    }
+  }
+  for (int i = used.size() - 1; i >= 0; i--) {
+    int archive = dhtArchive->contains(used.at(i)) ?
+      DHT_ARCHIVE : REDUNDANCY_ARCHIVE;
+    Files file = getArchive(archive)->value(used.at(i));
+    if (isIndexed(archive, used.at(i), file)) {
+      records.append(StoreRecord(STORE_PUT, archive, used.at(i), file));
+    }
+  }
+  QStringList hot = hotOrder->toList();
+  for (int i = hot.size() - 1; i >= 0; i--) {
+    Files file = hotArchive->value(hot.at(i));
+    if (isIndexed(HOT_ARCHIVE, hot.at(i), file)) {
+      records.append(StoreRecord(STORE_PUT, HOT_ARCHIVE, hot.at(i), file));
+    }
+  }
+
+  if (storeIndex->rewrite(records)) {
+    qDebug() << originID << "compacted store index to" << records.size()
+             << "records";
+  }
+}
+
+void NetSocket::dropHotCopy(QString filename) {
+  hotOrder->remove(filename);
+  remove(hotArchive->value(filename).filename.toStdString().c_str());
+  unarchiveFile(HOT_ARCHIVE, filename);
+  qDebug() << originID << "evicted hot file" << filename;
+}
+
+qint64 NetSocket::usedBytes(int archive) {
+  QList<int> kinds;
+  if (archive == HOT_ARCHIVE) {
+    kinds << HOT_ARCHIVE;
+  } else {
+    kinds << DHT_ARCHIVE << REDUNDANCY_ARCHIVE << FRAGMENT_ARCHIVE;
+  }
+  qint64 bytes = 0;
+  for (int i = 0; i < kinds.size(); i++) {
+    bytes += archiveBytes->value(kinds.at(i));
+  }
+  QHashIterator<QByteArray, QPair<int, qint64> > it(*reservations);
+  while (it.hasNext()) {
+    it.next();
+    if ((it.value().first == HOT_ARCHIVE) == (archive == HOT_ARCHIVE)) {
+      bytes += it.value().second;
+    }
+  }
+  return bytes;
 }
 
-void NetSocket::gotStartSearchFor(QPair<QString, quint32> pair) {
-  QVariantMap *msg = new QVariantMap();
-  msg->insert(ORIGIN, originID);
-  msg->insert(SEARCH, pair.first);
-  msg->insert(BUDGET, pair.second);
-  sendByBudget(*msg);
+bool NetSocket::reserveSpace(QString filename, qint64 bytes, int archive,
+                             QByteArray blocklistHash) {
+  qint64 limit = archive == HOT_ARCHIVE ? HOTCACHEBYTES : dhtSizeLimit;
+  if (bytes > limit) {
+    qDebug() << " >" << filename << "is larger than the limit of"
+             << formatSize(limit);
+    return false;
+  }
+  while (usedBytes(archive) + bytes > limit) {
+    if (archive == HOT_ARCHIVE) {
+      if (hotOrder->isEmpty()) {
+        return false;
+      }
+      dropHotCopy(hotOrder->last());
+      continue;
+    }
+    QString victim = evictionPolicy->victim();
+    // Redundant copies must be worth what they displace; a primary copy
+    // turned away would leave its key with no owner holding it
+    if (victim.isEmpty() || (archive != DHT_ARCHIVE &&
+                             !evictionPolicy->admit(filename, victim))) {
+      qDebug() << " >" << evictionPolicy->name() << "turning away"
+               << filename;
+      evictionPolicy->rejections++;
+      printEvictionStats();
+      return false;
+    }
+    evictDHTFile(victim);
+  }
+  reservations->insert(blocklistHash, qMakePair(archive, bytes));
+  qDebug() << " > using" << formatSize(usedBytes(archive)) << "of"
+           << formatSize(limit);
+  return true;
 }
 
 void NetSocket::sendByBudget(QVariantMap msg) {
@@ -1900,68 +5399,196 @@ void NetSocket::sendByBudget(QVariantMap msg) {
   }
 }
 
-void NetSocket::addToFingerTable(QString origin) {
-  fingerTable->addNode(nSpots, origin); 
-  transferToAddedNode();
+void NetSocket::addToFingerTable(QString origin, int vnodes) {
+  fingerTable->addNode(origin, vnodes); 
+  transferToAddedNode(origin);
 }
 
-void NetSocket::transferToAddedNode() {
-  FileSharing *toTransfer = new FileSharing();
-  QMapIterator<QString, Files> it(*dhtArchive);
-  while (it.hasNext()) {
-    it.next();
-    toTransfer->files.push_back(it.value());
+void NetSocket::setVnodes(int n) {
+  vnodeOverride = qMin(n, MAXVNODES);
+}
+
+void NetSocket::setReplicas(int n) {
+  replicas = qBound(1, n, MAXREPLICAS);
+}
+
+void NetSocket::setErasure(int k, int m) {
+  ecData = k;
+  ecParity = m;
+}
+
+bool NetSocket::isErasureCoded(Files file) {
+  // Files with fewer blocks than data fragments are replicated whole
+  return ecData > 0 && file.blocklist.size() / 20 >= ecData;
+}
+
+int NetSocket::myVnodes() {
+  if (vnodeOverride > 0) {
+    return vnodeOverride;
   }
+  // Weight ring share by declared capacity
+  return (int) qBound((qint64) 1, dhtSizeLimit / VNODEBYTES,
+                      (qint64) MAXVNODES);
+}
 
-  deleteDHTFilesFromNode(toTransfer);
-  gotShareFiles(toTransfer);
+void NetSocket::transferToAddedNode(QString origin) {
+  if (origin == originID) {
+    return;
+  }
+  // Each of origin's vnodes has taken the keys between its predecessor
+  // and itself; only owned files in those ranges move
+  QStringList moving;
+  int count = fingerTable->vnodeCounts->value(origin, 0);
+  for (int i = 0; i < count; i++) {
+    RingId high = fingerTable->vnodeHash(origin, i);
+    moving += ownedIn(fingerTable->predecessorOf(high), high);
+  }
+  for (int i = 0; i < moving.size(); i++) {
+    // Half-downloaded files are handed over once complete
+    if (!dhtArchive->value(moving.at(i)).blocklist.isEmpty()) {
+      handOff(moving.at(i), origin);
+    }
+  }
 }
 
-void NetSocket::deleteDHTFilesFromNode(FileSharing *toDelete) {
-  for (int i = 0; i < toDelete->files.size(); i++) {
-    Files file = toDelete->files.at(i);
-    // Delete dht_ file from directory
-    QString fileToDelete = "dht_" + file.filename;
-    remove(fileToDelete.toStdString().c_str());
-    if (dhtArchive->contains(file.filename)) {
-      dhtArchive->remove(file.filename);
-      int index = -1; 
-      if ((index = recentDHTFiles->indexOf(file.filename)) != -1) {
-        recentDHTFiles->remove(index); 
-        // qDebug() << "removed" << file.filename << "from recentDHTFiles";
-        // printRecentDHTFiles(); 
-      }
+QStringList NetSocket::ownedIn(RingId low, RingId high) {
+  QStringList names;
+  RingId width = high - low;
+  QMultiMap<RingId, QString>::const_iterator it = ownedKeys->upperBound(low);
+  for (int n = 0; n < ownedKeys->size(); n++) {
+    if (it == ownedKeys->constEnd()) {
+      it = ownedKeys->constBegin();
+    }
+    // Offsets from low handle ranges that wrap past zero
+    RingId offset = it.key() - low;
+    if (offset == RingId() || width < offset) {
+      break;
     }
+    names.append(it.value());
+    ++it;
+  }
+  return names;
+}
+
+void NetSocket::handOff(QString filename, QString owner) {
+  if (!offerFile(filename, owner, dhtArchive->value(filename).blocklistHash)) {
+    return;
+  }
+  // Serve it as a redundant copy until owner has fetched it
+  dropFragments(filename);
+  moveCopy(filename, REDUNDANCY_ARCHIVE);
+  handoffs->insert(filename, owner);
+}
+
+bool NetSocket::offerFile(QString filename, QString owner,
+                          QByteArray blocklistHash) {
+  Peer *peer = routingTable->value(owner);
+  if (peer == NULL) {
+    qDebug() << " > no route to" << owner << "to hand over" << filename;
+    return false;
+  }
+  QVariantMap *msg = new QVariantMap();
+  msg->insert(TYPE, MSG_TRANSFER);
+  msg->insert(ORIGIN, originID);
+  msg->insert(FILENAME, filename);
+  msg->insert(FILEHASH, fingerTable->getHash(filename).toByteArray());
+  msg->insert(BLOCKLISTHASH, blocklistHash);
+  sendMsg(msg, *peer);
+  qDebug() << " > handing" << filename << "over to" << owner;
+  return true;
+}
+
+void NetSocket::sendTransferAck(QString dest, QString filename) {
+  Peer *peer = routingTable->value(dest);
+  if (peer == NULL) {
+    return;
+  }
+  QVariantMap *msg = new QVariantMap();
+  msg->insert(TYPE, MSG_TRANSFERACK);
+  msg->insert(DEST, dest);
+  msg->insert(ORIGIN, originID);
+  msg->insert(HOPLIMIT, DEFLIM);
+  msg->insert(FILENAME, filename);
+  sendMsg(msg, *peer);
+}
+
+void NetSocket::moveCopy(QString filename, int to) {
+  int from = DHT_ARCHIVE;
+  QString oldName = "dht_" + filename;
+  QString newName = "red_" + filename;
+  if (to == DHT_ARCHIVE) {
+    from = REDUNDANCY_ARCHIVE;
+    oldName = "red_" + filename;
+    newName = "dht_" + filename;
+  }
+  Files file = getArchive(from)->value(filename);
+  unarchiveFile(from, filename);
+  archiveFile(to, filename, file);
+  if (!file.packed && !QFile::rename(oldName, newName)) {
+    qDebug() << "error: could not rename" << oldName << "to" << newName;
   }
 }
 
 void NetSocket::printRecentDHTFiles() {
   qDebug() << "------------ recentDHTFiles for " << getThisPort()
+           << "by" << evictionPolicy->name()
            << " ----------------"; 
-  for (int i = 0; i < recentDHTFiles->size(); i++) {
-    qDebug() << "" << i << "" << recentDHTFiles->at(i); 
+  QStringList files = evictionPolicy->toList();
+  for (int i = 0; i < files.size(); i++) {
+    qDebug() << "" << i << "" << files.at(i); 
   }
   qDebug() << "--------------------------------------------------------"; 
 }
 
-void NetSocket::gotDeleteRedundancies() {
-  // Delete files from recentDHTFiles, directory, and redunancyArchive
+void NetSocket::gotRingChanged() {
+  // Owners learned before the change may no longer own their keys
+  ownerCache->clear();
+
+  // Keep redundant copies this node is still a successor for, take over
+  // those whose owner has gone, and delete the rest from
+  // the eviction policy, directory, and redundancyArchive
   QMapIterator<QString, Files> it(*redundancyArchive);
   while (it.hasNext()) {
     it.next();
-    removeFromRecentDHTFiles(it.key());
-    QString fileToDelete = "dht_" + it.key();
+    RingId key = fingerTable->getHash(it.key());
+    bool fragment = fragmentSets->contains(it.key());
+    if (fingerTable->ownerOf(key) == originID) {
+      handoffs->remove(it.key());
+      // Copies still downloading are picked up on a later change
+      if (fragment) {
+        rebuildFile(it.key());
+      } else if (!it.value().blocklist.isEmpty()) {
+        qDebug() << " > promoting redundant copy of" << it.key();
+        moveCopy(it.key(), DHT_ARCHIVE);
+      }
+      continue;
+    }
+    int width = replicas;
+    if (fragment) {
+      width = fragmentSets->value(it.key()).value(FRAGMENTS).toList().size();
+    }
+    if (handoffs->contains(it.key()) ||
+        fingerTable->replicasOf(key, width).contains(originID)) {
+      continue;
+    }
+    evictionPolicy->remove(it.key(), false);
+    QString fileToDelete = "red_" + it.key();
     remove(fileToDelete.toStdString().c_str());
+    unarchiveFile(REDUNDANCY_ARCHIVE, it.key());
+    fragmentSets->remove(it.key());
+    rebuilds->remove(it.key());
   }
-  redundancyArchive->clear();
-}
 
-void NetSocket::removeFromRecentDHTFiles(QString filename) {
-  for (int i = 0; i < recentDHTFiles->size(); i++) {
-    if (recentDHTFiles->at(i) == filename) {
-      recentDHTFiles->remove(i);
-      return;
+  // Top up the replica sets of files still owned; files a new node has
+  // taken are handed over by transferToAddedNode
+  QMapIterator<QString, Files> owned(*dhtArchive);
+  while (owned.hasNext()) {
+    owned.next();
+    if (owned.value().blocklist.isEmpty() ||
+        fingerTable->ownerOf(fingerTable->getHash(owned.key())) != originID) {
+      continue;
     }
+    sendReplicas(owned.value());
   }
 }
 
@@ -1973,12 +5600,20 @@ void NetSocket::gotChangedDHTPreference(int state) {
   if (state == Qt::Checked) {
     joinDHT = true;
     qDebug() << ">>>>>>>>>>>>> user indicated wants to join DHT";
+    if (leaving) {
+      // Rejoining before the last leave finished; keep what is left
+      leaving = false;
+      leaveTimer->stop();
+    }
+    // Take this node's share of the ring
+    fingerTable->addNode(originID, myVnodes());
+    msg->insert(VNODES, myVnodes());
     // Add any positive join requests in dhtStatus to DHT
     QMapIterator<QString, QPair<quint32, bool> > it(*dhtStatus);
     while (it.hasNext()) {
       it.next();
-      if (it.value().second == true) {
-        addToFingerTable(it.key());
+      if (it.value().second == true && it.key() != originID) {
+        addToFingerTable(it.key(), dhtVnodes->value(it.key(), 1));
         if (!hasJoinedDHT) {
           hasJoinedDHT = true;
           emit joinedDHT();
@@ -1988,20 +5623,21 @@ void NetSocket::gotChangedDHTPreference(int state) {
   } else {
     joinDHT = false;
     if (hasJoinedDHT) {
-      oneAhead = fingerTable->items.at(0)->originID;
+      oneAhead = fingerTable->oneAhead;
       // Note replacement node for finger tables, unless current node
       // is only node in DHT
       if (oneAhead != originID) {
         msg->insert(REPLACEMENT, oneAhead);
         msg->insert(ONEBEHIND, fingerTable->oneBehind);
-        fingerTable->items.at(0)->originID = oneAhead;
         transferFiles = true;
       }
     }
   }
  
+  msg->insert(TYPE, MSG_RUMOR);
   msg->insert(ORIGIN, originID);
   msg->insert(SEQNO, dhtSeqNo++);
+  logOrigin();
   msg->insert(JOINDHT, joinDHT);
 
   // Update dhtStatus
@@ -2013,35 +5649,140 @@ void NetSocket::gotChangedDHTPreference(int state) {
   if ((state != Qt::Checked) && hasJoinedDHT) {
     // Transfer/reallocate files when leaving DHT
     if (transferFiles) {
-      // Remove own originID from fingerTable
-      int ftSize = fingerTable->items.size();
-      for (int i = 0; i < ftSize; i++) {
-        if (fingerTable->items.at(i)->originID == originID) {
-          fingerTable->items.at(i)->originID = oneAhead;
+      // Remove own vnodes from the ring, so files go to their new owners
+      fingerTable->removeNode(originID);
+      // Hand each file this node is in charge of to its new owner, and
+      // keep serving them until each one is acknowledged
+      QList<QString> owned = dhtArchive->keys();
+      for (int i = 0; i < owned.size(); i++) {
+        if (!dhtArchive->value(owned.at(i)).blocklist.isEmpty()) {
+          handOff(owned.at(i),
+                  fingerTable->ownerOf(fingerTable->getHash(owned.at(i))));
         }
       }
-      // Transfer files this node is in charge of, to next node
-      QMapIterator<QString, Files> it(*dhtArchive);
-      while (it.hasNext()) {
-        it.next();
-        QString fileName = it.key();
-        Files *file = new Files();
-        FileSharing *share = new FileSharing();
-        file = share->getFile(fileName);
-        QVariantMap *fileMsg = new QVariantMap();
-        int fileHash = fingerTable->getHash(nSpots, file->filename);
-        fileMsg->insert(ORIGIN, originID);
-        fileMsg->insert(FILENAME, file->filename);
-        fileMsg->insert(FILEHASH, fileHash);
-        fileMsg->insert(BLOCKLISTHASH, file->blocklistHash);
-        sendThroughFingerTable(fileMsg);
+      if (!handoffs->isEmpty()) {
+        leaving = true;
+        leaveTries = 1;
+        leaveTimer->start(LEAVERETRY);
+        return;
+      }
+    }
+    finishLeave();
+  }
+}
+
+void NetSocket::gotLeaveTimeout() {
+  if (leaveTries >= LEAVERETRIES) {
+    qDebug() << " >" << handoffs->size()
+             << "handoffs unacknowledged, leaving anyway";
+    finishLeave();
+    return;
+  }
+  leaveTries++;
+  // Offer what is still outstanding again, to whoever owns it now
+  QHashIterator<QString, QString> it(*handoffs);
+  while (it.hasNext()) {
+    it.next();
+    QString owner = fingerTable->ownerOf(fingerTable->getHash(it.key()));
+    handoffs->insert(it.key(), owner);
+    offerFile(it.key(), owner, redundancyArchive->value(it.key()).blocklistHash);
+  }
+}
+
+void NetSocket::finishLeave() {
+  leaving = false;
+  leaveTimer->stop();
+  hasJoinedDHT = false;
+  // Nothing hands over or re-offers a copy once stabilizing stops, so
+  // drop the ones never acknowledged. Owned files stay only if this
+  // node was alone on the ring, with no one to give them to.
+  QList<QString> left = handoffs->keys();
+  if (!fingerTable->vnodeCounts->contains(originID)) {
+    left.append(dhtArchive->keys());
+  }
+  for (int i = 0; i < left.size(); i++) {
+    qDebug() << " > dropping" << left.at(i) << "on leaving";
+    dropCopy(left.at(i));
+    evictionPolicy->remove(left.at(i), false);
+  }
+  handoffs->clear();
+  // Report to GUI that has left DHT
+  emit(leftDHT());
+}
+
+void NetSocket::gotStabilizeTimeout() {
+  if (!hasJoinedDHT) {
+    return;
+  }
+  // Watch the fingers, both ring neighbours, the successors holding
+  // this node's replicas, and nodes dropped for silence in case they
+  // come back
+  QSet<QString> watch;
+  for (int i = 0; i < fingerTable->items.size(); i++) {
+    watch.insert(fingerTable->items.at(i)->originID);
+  }
+  watch.insert(fingerTable->oneBehind);
+  QStringList successors = fingerTable->replicasOf(fingerTable->curHash,
+                                                   replicas);
+  for (int i = 0; i < successors.size(); i++) {
+    watch.insert(successors.at(i));
+  }
+  watch.unite(*presumedDead);
+  // Owners this node holds files for, so that they are dropped or
+  // handed their files
+  QHashIterator<QString, QString> held(*handoffs);
+  while (held.hasNext()) {
+    watch.insert(held.next().value());
+  }
+  watch.remove(originID);
+
+  qint64 now = liveClock.elapsed();
+  QMutableHashIterator<QString, qint64> stale(*pingSent);
+  while (stale.hasNext()) {
+    if (!watch.contains(stale.next().key())) {
+      stale.remove();
+    }
+  }
+  QSetIterator<QString> it(watch);
+  while (it.hasNext()) {
+    QString node = it.next();
+    if (!pingSent->contains(node)) {
+      pingSent->insert(node, now);
+    } else if (!presumedDead->contains(node)) {
+      qint64 waited = now - pingSent->value(node);
+      if (waited >= DEADTIMEOUT) {
+        declareDead(node);
+        continue;
+      } else if (waited >= SUSPECTTIMEOUT && !suspected->contains(node)) {
+        qDebug() << " >" << node << "is not answering, routing around it";
+        suspected->insert(node);
       }
-      sleep(5);
     }
-    hasJoinedDHT = false;
-    // Report to GUI that has left DHT
-    emit(leftDHT());
+    // Probes are resent every tick until answered, in case of loss
+    sendProbe(MSG_PING, node);
+  }
+}
+
+void NetSocket::declareDead(QString node) {
+  qDebug() << "<<<<<<<<<<<<<" << node << "presumed dead, dropping it";
+  suspected->remove(node);
+  presumedDead->insert(node);
+  // Its successors promote their replicas of its keys
+  fingerTable->removeNode(node);
+  fingerTable->printFingerTable();
+}
+
+void NetSocket::sendProbe(int type, QString dest) {
+  Peer *peer = routingTable->value(dest);
+  if (peer == NULL) {
+    return;
   }
+  QVariantMap *msg = new QVariantMap();
+  msg->insert(TYPE, type);
+  msg->insert(DEST, dest);
+  msg->insert(ORIGIN, originID);
+  msg->insert(HOPLIMIT, DEFLIM);
+  sendMsg(msg, *peer);
 }
 
 void NetSocket::updateDhtStatus(QVariantMap *msg) {
@@ -2050,6 +5791,10 @@ void NetSocket::updateDhtStatus(QVariantMap *msg) {
     msg->value(SEQNO).toUInt() + 1;
   (*dhtStatus)[msg->value(ORIGIN).toString()].second =
     msg->value(JOINDHT).toBool();
+  if (msg->contains(VNODES)) {
+    dhtVnodes->insert(msg->value(ORIGIN).toString(),
+                      msg->value(VNODES).toInt());
+  }
 }
 
 void NetSocket::processJoinReq(QVariantMap msg, Peer *senderPeer) {
@@ -2067,9 +5812,11 @@ void NetSocket::processJoinReq(QVariantMap msg, Peer *senderPeer) {
       while (it.hasNext()) {
         it.next();
         QVariantMap *statMsg = new QVariantMap();
+        statMsg->insert(TYPE, MSG_RUMOR);
         statMsg->insert(ORIGIN, it.key());
         statMsg->insert(SEQNO, it.value().first - 1);
         statMsg->insert(JOINDHT, it.value().second);
+        statMsg->insert(VNODES, dhtVnodes->value(it.key(), 1));
         statMsg->insert(BROADCAST, true);
         sendMsg(statMsg, *senderPeer);
       }
@@ -2077,67 +5824,415 @@ void NetSocket::processJoinReq(QVariantMap msg, Peer *senderPeer) {
     // Add msg origin to DHT
     qDebug() << "<<<<<<<<<<<<< received request from"
              << msg[ORIGIN].toString() << "to join DHT";
-    addToFingerTable(msg.value(ORIGIN).toString());
+    addToFingerTable(msg.value(ORIGIN).toString(),
+                     dhtVnodes->value(msg.value(ORIGIN).toString(), 1));
   }
 }
 
 void NetSocket::processLeaveReq(QVariantMap msg) {
   QString orig = msg.value(ORIGIN).toString();
-  QString repl = msg.value(REPLACEMENT).toString();
-  int ftSize = fingerTable->items.size();
-  // Replace all occurences of leaving originID with specified replacement
-  for (int i = 0; i < ftSize; i++) {
-    if (fingerTable->items.at(i)->originID == orig) {
-      fingerTable->items.at(i)->originID = repl;
-    }
-  }
+  pingSent->remove(orig);
+  suspected->remove(orig);
+  presumedDead->remove(orig);
+  // gotRingChanged promotes copies orig owned and refills the replica
+  // sets it was part of
+  fingerTable->removeNode(orig);
   qDebug() << "<<<<<<<<<<<<<" << orig << "left DHT";
   fingerTable->printFingerTable();
-  // If I am the replacement, update oneBehind and tell it to keep
-  // redunant copies of my files
-  if (orig == fingerTable->oneBehind) {
-    fingerTable->oneBehind = msg.value(ONEBEHIND).toString();
-    FileSharing *toCopy = new FileSharing();
-    QMapIterator<QString, Files> it(*dhtArchive);
-    while (it.hasNext()) {
-      it.next();
-      toCopy->files.push_back(it.value());
-    }
-    sendRedundancies(toCopy);
-  }
 }
 
 void NetSocket::sendRedundancies(FileSharing *toCopy) {
-  Peer *peer = routingTable->value(fingerTable->oneBehind);
   QVectorIterator<Files> it(toCopy->files);
   while (it.hasNext()) {
-    Files file = it.next();
+    sendReplicas(it.next());
+  }
+}
+
+void NetSocket::sendReplicas(Files file) {
+  if (isErasureCoded(file)) {
+    sendFragments(file);
+  } else {
+    sendWholeCopies(file);
+  }
+}
+
+void NetSocket::sendWholeCopies(Files file) {
+  RingId fileHash = fingerTable->getHash(file.filename);
+  QStringList holders = fingerTable->replicasOf(fileHash, replicas);
+  QStringList sent = replicaHolders->value(file.filename);
+  // Holders that dropped out of the list delete their own copies
+  QStringList kept;
+  for (int i = 0; i < holders.size(); i++) {
+    QString holder = holders.at(i);
+    if (sent.contains(holder)) {
+      kept.append(holder);
+      continue;
+    }
+    Peer *peer = routingTable->value(holder);
+    if (peer == NULL) {
+      continue;
+    }
     QVariantMap *msg = new QVariantMap();
-    int fileHash = fingerTable->getHash(nSpots, file.filename);
+    msg->insert(TYPE, MSG_TRANSFER);
     msg->insert(ORIGIN, originID);
     msg->insert(FILENAME, file.filename);
-    msg->insert(FILEHASH, fileHash);
+    msg->insert(FILEHASH, fileHash.toByteArray());
     msg->insert(BLOCKLISTHASH, file.blocklistHash);
-    msg->insert(REDUNDANT, fingerTable->oneBehind);
+    msg->insert(REDUNDANT, holder);
+    sendMsg(msg, *peer);
+    kept.append(holder);
+    qDebug() << " > sent out redundant copy to" << holder;
+  }
+  replicaHolders->insert(file.filename, kept);
+}
+
+void NetSocket::sendFragments(Files file) {
+  int n = ecData + ecParity;
+  QVariantList hashes;
+  for (int i = 0; i < n; i++) {
+    QString key = fragmentName(file.filename, i);
+    if (!fragmentArchive->contains(key)) {
+      // storeFragment comes back here once parity is ready
+      encodeFile(file);
+      return;
+    }
+    hashes.append(fragmentArchive->value(key).blocklistHash);
+  }
+
+  // Fragment i stays with holders[i] for as long as it remains one of
+  // the n successors; only freed fragments move
+  RingId fileHash = fingerTable->getHash(file.filename);
+  QStringList candidates = fingerTable->replicasOf(fileHash, n);
+  QStringList holders = replicaHolders->value(file.filename);
+  bool changed = false;
+  for (int i = 0; i < n; i++) {
+    if (i >= holders.size()) {
+      holders.append(QString());
+    } else if (!holders.at(i).isEmpty() &&
+               !candidates.contains(holders.at(i))) {
+      holders[i] = QString();
+      changed = true;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < candidates.size() && holders.at(i).isEmpty(); j++) {
+      if (!holders.contains(candidates.at(j)) &&
+          routingTable->value(candidates.at(j)) != NULL) {
+        holders[i] = candidates.at(j);
+        changed = true;
+      }
+    }
+  }
+  replicaHolders->insert(file.filename, holders);
+  if (!changed) {
+    return;
+  }
+
+  // Every holder learns where the others are, so any of them can
+  // rebuild the file; only new holders download anything
+  for (int i = 0; i < n; i++) {
+    Peer *peer = routingTable->value(holders.at(i));
+    if (peer == NULL) {
+      continue;
+    }
+    QVariantMap *msg = new QVariantMap();
+    msg->insert(TYPE, MSG_TRANSFER);
+    msg->insert(ORIGIN, originID);
+    msg->insert(FILENAME, file.filename);
+    msg->insert(FILEHASH, fileHash.toByteArray());
+    msg->insert(BLOCKLISTHASH, hashes.at(i));
+    msg->insert(REDUNDANT, holders.at(i));
+    msg->insert(FRAGMENT, i);
+    msg->insert(FRAGMENTS, hashes);
+    msg->insert(ERASURE, ecData);
+    msg->insert(HOLDERS, holders);
+    msg->insert(FILESIZE, file.filesize);
     sendMsg(msg, *peer);
-     qDebug() << " > sent out redundant copy to"
-              << fingerTable->oneBehind;
   }
+  qDebug() << " > sent out fragments of" << file.filename << "to" << holders;
+}
+
+void NetSocket::encodeFile(Files file) {
+  if (encoding->contains(file.filename)) {
+    return;
+  }
+  QByteArray data;
+  if (file.packed) {
+    data = chunkStore->readFile(file.blocklist);
+  } else {
+    QFile in(file.filename);
+    if (in.open(QIODevice::ReadOnly)) {
+      data = in.readAll();
+    }
+  }
+  if (data.size() != file.filesize) {
+    qDebug() << "error: could not read" << file.filename << "to encode it";
+    return;
+  }
+  ErasureCode code(ecData, ecParity);
+  QList<QByteArray> parity = code.encode(splitStripes(data, ecData));
+  encoding->insert(file.filename);
+
+  // Data fragments are the file's own blocks, so the owner serves them
+  // from its copy: their block hashes find the dhtArchive entry first
+  QCA::Hash shaHash("sha1");
+  for (int j = 0; j < ecData; j++) {
+    Files frag;
+    frag.filename = file.filename;
+    frag.blocklist = fragmentBlocklist(file.blocklist, ecData, j);
+    shaHash.update(frag.blocklist);
+    frag.blocklistHash = shaHash.final().toByteArray();
+    shaHash.clear();
+    archiveFile(FRAGMENT_ARCHIVE, fragmentName(file.filename, j), frag);
+  }
+
+  // Parity is written out and hashed on the worker pool
+  for (int p = 0; p < ecParity; p++) {
+    int i = ecData + p;
+    QString path = "dht_" + fragmentName(file.filename, i);
+    QFile out(path);
+    if (!out.open(QIODevice::WriteOnly)) {
+      qDebug() << "error: could not write" << path;
+      dropFragments(file.filename);
+      return;
+    }
+    out.write(parity.at(p));
+    out.close();
+    QVariantMap context;
+    context.insert(FILENAME, file.filename);
+    context.insert(FRAGMENT, i);
+    ingestFile(path, INGEST_FRAGMENT, context);
+  }
+}
+
+void NetSocket::dropFragments(QString filename) {
+  encoding->remove(filename);
+  replicaHolders->remove(filename);
+  for (int i = 0; i < MAXFRAGMENTS; i++) {
+    QString key = fragmentName(filename, i);
+    if (!fragmentArchive->contains(key)) {
+      continue;
+    }
+    // Only parity has a file of its own
+    if (fragmentArchive->value(key).filename != filename) {
+      QString fileToDelete = fragmentArchive->value(key).filename;
+      remove(fileToDelete.toStdString().c_str());
+    }
+    unarchiveFile(FRAGMENT_ARCHIVE, key);
+  }
+}
+
+void NetSocket::rebuildFile(QString filename) {
+  if (rebuilds->contains(filename) ||
+      redundancyArchive->value(filename).blocklist.isEmpty()) {
+    return;
+  }
+  QVariantMap set = fragmentSets->value(filename);
+  QVariantList hashes = set.value(FRAGMENTS).toList();
+  QStringList holders = set.value(HOLDERS).toStringList();
+  int mine = set.value(FRAGMENT).toInt();
+  QMap<int, QString> have;
+  have.insert(mine, "red_" + filename);
+  rebuilds->insert(filename, have);
+  qDebug() << " > rebuilding" << filename << "from its fragments";
+
+  // Fetch every other fragment still on the ring; the first k to
+  // arrive are enough
+  for (int j = 0; j < hashes.size() && j < holders.size(); j++) {
+    if (j == mine || !fingerTable->vnodeCounts->contains(holders.at(j))) {
+      continue;
+    }
+    QByteArray hash = hashes.at(j).toByteArray();
+    fragmentDownloads->insert(hash, qMakePair(filename, j));
+    gotReqToDownload(qMakePair(fragmentName(filename, j),
+                               qMakePair(hash, holders.at(j))), true);
+  }
+  finishRebuild(filename);
+}
+
+void NetSocket::finishRebuild(QString filename) {
+  QMap<int, QString> have = rebuilds->value(filename);
+  QVariantMap set = fragmentSets->value(filename);
+  int k = set.value(ERASURE).toInt();
+  if (k < 1 || have.size() < k) {
+    return;
+  }
+  int n = set.value(FRAGMENTS).toList().size();
+  qint64 size = set.value(FILESIZE).toLongLong();
+  int len = (int) (stripeCount(size, k) * MAXBYTES);
+
+  // Data fragments lack the padding of the last stripe
+  QMap<int, QByteArray> frags;
+  QMapIterator<int, QString> it(have);
+  while (it.hasNext() && frags.size() < k) {
+    it.next();
+    QFile in(it.value());
+    if (!in.open(QIODevice::ReadOnly)) {
+      qDebug() << "error: could not read fragment" << it.value();
+      continue;
+    }
+    QByteArray frag = in.readAll();
+    if (frag.size() < len) {
+      frag.append(QByteArray(len - frag.size(), '\0'));
+    }
+    frags.insert(it.key(), frag.left(len));
+  }
+  QList<QByteArray> data = ErasureCode(k, n - k).decode(frags);
+  if (data.isEmpty()) {
+    qDebug() << "error: could not rebuild" << filename;
+    return;
+  }
+  QString path = "dht_" + filename;
+  QFile out(path);
+  if (!out.open(QIODevice::WriteOnly)) {
+    qDebug() << "error: could not write" << path;
+    return;
+  }
+  out.write(joinStripes(data, size));
+  out.close();
+
+  // The fragments are done with; the rebuilt file is taken on as owned
+  // and coded afresh
+  QList<QString> paths = have.values();
+  for (int i = 0; i < paths.size(); i++) {
+    remove(paths.at(i).toStdString().c_str());
+  }
+  rebuilds->remove(filename);
+  fragmentSets->remove(filename);
+  evictionPolicy->remove(filename, false);
+  unarchiveFile(REDUNDANCY_ARCHIVE, filename);
+  qDebug() << " > rebuilt" << filename << "from" << k << "fragments";
+  ingestFile(path, INGEST_OWNED, QVariantMap());
+}
+
+// DAEMON FUNCTIONS ------------------------------------------------
+
+Daemon::Daemon() {
+  sock = new NetSocket();
+  if (!sock->bind()) {
+    exit(1);
+  }
+  connect(sock, SIGNAL(chatText(QString, QString)),
+          this, SLOT(gotChatText(QString, QString)));
+  connect(sock, SIGNAL(joinedDHT()), this, SLOT(gotJoinedDHT()));
+  connect(sock, SIGNAL(leftDHT()), this, SLOT(gotLeftDHT()));
+
+  join = false;
+  shared = false;
+
+  // Peers are already handled by NetSocket::bind
+  QStringList args = QCoreApplication::arguments();
+  for (int i = 1; i < args.size(); i++) {
+    if (args.at(i).startsWith(QChar('-'))) {
+      applyOption(args.at(i));
+    }
+  }
+
+  qDebug() << ">>>>>>>>>>>>> running headless as" << sock->getOriginID()
+           << "on port" << sock->getThisPort();
+  if (join) {
+    // Share once there is a DHT to share into
+    sock->gotChangedDHTPreference(Qt::Checked);
+  } else {
+    shareFiles();
+  }
+}
+
+bool Daemon::applyOption(QString opt) {
+  QString name = opt.section(QChar('='), 0, 0);
+  QString value = opt.section(QChar('='), 1);
+
+  if (name == QString("-daemon")) {
+    // Handled by main
+  } else if (name == QString("-joindht")) {
+    join = true;
+  } else if (name == QString("-share")) {
+    toShare.append(value);
+  } else if (name == QString("-config")) {
+    readConfig(value);
+  } else {
+    return sock->applyOption(opt);
+  }
+  return true;
+}
+
+void Daemon::readConfig(QString path) {
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+    qDebug() << "error: could not open config file" << path;
+    return;
+  }
+
+  while (!file.atEnd()) {
+    QByteArray raw = file.readLine();
+    QString line = QString::fromUtf8(raw.constData(), raw.size()).trimmed();
+    if (line.isEmpty() || line.startsWith(QChar('#'))) {
+      continue;
+    }
+    if (!line.startsWith(QChar('-'))) {
+      sock->argToPeer(line);
+    } else if (!applyOption(line)) {
+      qDebug() << " > in" << path;
+    }
+  }
+}
+
+void Daemon::shareFiles() {
+  if (shared || toShare.isEmpty()) {
+    return;
+  }
+  shared = true;
+
+  FileSharing *share = new FileSharing();
+  connect(share, SIGNAL(shareFiles(FileSharing*)),
+          sock, SLOT(gotShareFiles(FileSharing*)));
+  share->gotFilesSelected(toShare);
+}
+
+void Daemon::gotChatText(QString sender, QString text) {
+  qDebug() << sender << ":" << text;
+}
+
+void Daemon::gotJoinedDHT() {
+  qDebug() << ">>>>>>>>>>>>> joined DHT with"
+           << formatSize(sock->dhtSizeLimit);
+  shareFiles();
+}
+
+void Daemon::gotLeftDHT() {
+  qDebug() << ">>>>>>>>>>>>> left DHT";
 }
 
 // MAIN ------------------------------------------------
 
 int main(int argc, char **argv) {
-  // Initialize Qt toolkit
-  QApplication app(argc,argv);
+#ifndef PEERSTER_DAEMON
+  // Run headless if asked, before any widget code
+  bool headless = false;
+  for (int i = 1; i < argc; i++) {
+    if (QString(argv[i]) == QString("-daemon")) {
+      headless = true;
+    }
+  }
 
-  QCA::Initializer qcainit;
+  if (!headless) {
+    // Initialize Qt toolkit
+    QApplication app(argc,argv);
 
-  // Create an initial chat dialog window
-  ChatDialog dialog;
-  dialog.show();
+    QCA::Initializer qcainit;
 
-  // Enter the Qt main loop; everything else is event driven
+    // Create an initial chat dialog window
+    ChatDialog dialog;
+    dialog.show();
+
+    // Enter the Qt main loop; everything else is event driven
+    return app.exec();
+  }
+#endif
+
+  QCoreApplication app(argc, argv);
+  QCA::Initializer qcainit;
+  Daemon daemon;
   return app.exec();
 }
 
@@ -1,6 +1,9 @@
 #ifndef PEERSTER_MAIN_HH
 #define PEERSTER_MAIN_HH
 
+// Built with CONFIG+=daemon, the node runs headless only and needs no
+// QtGui
+#ifndef PEERSTER_DAEMON
 #include <QDialog>
 #include <QTextEdit>
 #include <QLineEdit>
@@ -11,15 +14,20 @@
 #include <QListWidget>
 #include <QCheckBox>
 #include <QHBoxLayout>
-
-#include <QUdpSocket>
 #include <QKeyEvent>
 #include <QWidget>
+#endif
+
+#include <QUdpSocket>
 #include <QVector>
 #include <QHostInfo>
 #include <QHash>
 #include <QPair>
+#include <QElapsedTimer>
+#include <QSet>
+#include <QFutureWatcher>
 
+#ifndef PEERSTER_DAEMON
 class TextEdit : public QTextEdit {
   Q_OBJECT
 public:
@@ -34,6 +42,7 @@ private:
   void keyPressEvent(QKeyEvent *event);
   void keyReleaseEvent(QKeyEvent *event);
 };
+#endif
 
 class Peer {
 public:
@@ -47,6 +56,69 @@ public:
   quint16 port;
 };
 
+// Kinds of message, each with a handler registered in NetSocket.
+// MSG_UNTYPED messages, from peers that don't send a type, are
+// classified by their fields. Append only: peers exchange these values.
+enum MsgType { MSG_UNTYPED, MSG_STATUS, MSG_RUMOR, MSG_PRIVATE,
+               MSG_BLOCKREQ, MSG_BLOCKREPLY, MSG_SEARCH, MSG_SEARCHREPLY,
+               MSG_TRANSFER, MSG_TRANSFERACK, MSG_PING, MSG_PONG,
+               MSG_FINDSUCC, MSG_FINDSUCCREPLY };
+
+// Location of one field inside a binary-encoded datagram
+class WireField {
+public:
+  // Numeric tag standing in for the field name, or 0 if the name follows
+  quint8 tag;
+  // Offset and length of the field name, for tag 0
+  int nameOffset;
+  int nameLength;
+  // Type of the value, and offset/length of its encoding
+  quint8 valueType;
+  int offset;
+  int length;
+};
+
+// A datagram in the compact binary wire format: a typed header followed
+// by fields with numeric tags in place of the QVariantMap key strings.
+// Parsing only records where each field lies in the datagram.
+class WireMessage {
+public:
+  static const int MAXFIELDS = 32;
+
+  WireMessage();
+  // Encode msg, or return an empty array if it holds a value the binary
+  // format cannot carry
+  static QByteArray encode(QVariantMap msg);
+  // Locate the fields of datagram, returning false if it is not a
+  // well-formed binary message
+  bool parse(QByteArray datagram);
+  // Index in fields of the tagged field with the given name, or -1
+  int find(QString name);
+  // Decode the value of fields[i]
+  QVariant value(int i);
+  // Read the string or byte array field with the given name straight
+  // from the datagram, or return an empty one if there is no such field.
+  // bytes shares the datagram's buffer, so is only good while this
+  // message is: detach it to keep it.
+  QByteArray bytes(QString name);
+  QString string(QString name);
+  // Read the list of strings with the given name, or an empty list
+  QStringList strings(QString name);
+  // Decode every field into the QVariantMap form
+  QVariantMap toMap();
+
+  quint8 version;
+  // MsgType of the message
+  quint8 type;
+  int nFields;
+  WireField fields[MAXFIELDS];
+
+private:
+  // Shares the datagram's buffer rather than copying it
+  QByteArray raw;
+};
+
+#ifndef PEERSTER_DAEMON
 class PrivateMessage : public QWidget {
   Q_OBJECT
 public:
@@ -63,6 +135,7 @@ signals:
 public slots:
   void gotReturn();
 };
+#endif
 
 class Files {
 public:
@@ -71,41 +144,312 @@ public:
   QByteArray blocklist;
   QByteArray blocklistHash;
   qint64 filesize;
+  // Whether the blocks are kept in the chunk store rather than in the
+  // file named filename
+  bool packed;
+};
+
+// Chunks a file and hashes its blocks on the worker pool, several
+// block ranges at once, then reports the finished Files
+class FileIngest : public QObject {
+  Q_OBJECT
+public:
+  FileIngest(QString p, int pur, QVariantMap ctx);
+  // Start hashing; finished is emitted once done, possibly before
+  // start returns if the file cannot be read
+  void start();
+
+  QString path;
+  // What the file is being ingested for (IngestPurpose), and whatever
+  // the requester needs to carry on afterwards
+  int purpose;
+  QVariantMap context;
+  // The result, valid if ok
+  Files file;
+  bool ok;
+
+signals:
+  void finished(FileIngest *ingest);
+
+private slots:
+  void gotRangeHashed();
+
+private:
+  // One watcher per block range, in file order
+  QList<QFutureWatcher<QByteArray>*> ranges;
+  int remaining;
+};
+
+// What a file is being ingested for
+enum IngestPurpose { INGEST_SHARE, INGEST_OWNED, INGEST_REDUNDANT,
+                     INGEST_FRAGMENT };
+
+// Archives a file can be stored in, in the order findBlock prefers them
+enum ArchiveKind { DHT_ARCHIVE, REDUNDANCY_ARCHIVE, FILE_ARCHIVE,
+                   FRAGMENT_ARCHIVE, HOT_ARCHIVE };
+
+// Kinds of record in the store index. Append only: indexes written by
+// older builds are read back by position.
+enum StoreOp { STORE_ORIGIN, STORE_PUT, STORE_DELETE, STORE_TOUCH };
+
+// A change to the archives, as kept in the store index
+class StoreRecord {
+public:
+  StoreRecord();
+  StoreRecord(int o, int a, QString k, Files f);
+  // StoreOp
+  int op;
+  // ArchiveKind of the archive changed
+  int archive;
+  // Key in the archive, or this node's originID for STORE_ORIGIN
+  QString key;
+  // File stored under key, for STORE_PUT
+  Files file;
+  // Next sequence numbers of this node's rumors and DHT messages, for
+  // STORE_ORIGIN; 0 in indexes written before they were kept
+  quint32 seqNo;
+  quint32 dhtSeqNo;
+};
+
+// Append-only log of the archives' contents, so that a restarted node
+// gets them back without rehashing any file. The log is read back
+// through a memory map; a record torn by a crash is dropped.
+class StoreIndex {
+public:
+  StoreIndex(QString p);
+  ~StoreIndex();
+  // Every intact record in the index, in the order they were written
+  QList<StoreRecord> load();
+  // Append r, returning false if it could not be written
+  bool append(StoreRecord r);
+  // Replace the index with records
+  bool rewrite(QList<StoreRecord> records);
+  // Records appended since the index was last written whole
+  int appended;
+
+private:
+  static QByteArray encode(StoreRecord r);
+  // Decode the record at pos, returning false if it is torn or corrupt
+  static bool decode(const char *data, int size, int &pos, StoreRecord &r);
+  QString path;
+  // Open for appending once the index has been written whole
+  QFile *log;
+};
+
+// Where a block is kept in the chunk store
+class ChunkLocation {
+public:
+  ChunkLocation();
+  int segment;
+  // Offset of the block's data in the segment
+  qint64 offset;
+  int length;
+  // Archive entries and downloads holding the block
+  int refs;
+};
+
+// Blocks of the copies a node keeps for the DHT, appended to large
+// segment files and addressed by SHA-1, so that serving a block is one
+// pread on a file that is already open. Blocks nothing refers to are
+// left in place and their segments compacted a batch at a time.
+class ChunkStore {
+public:
+  ChunkStore(QString p);
+  ~ChunkStore();
+  // Find the blocks already in this store's segments
+  void open();
+  bool contains(QByteArray hash);
+  // Whether every block of blocklist is in the store
+  bool containsAll(QByteArray blocklist);
+  // Store data under hash, unreferenced, unless it is there already
+  bool write(QByteArray hash, QByteArray data);
+  // The block stored under hash, or empty if there is none
+  QByteArray read(QByteArray hash);
+  // The blocks of blocklist one after another, or empty if any is missing
+  QByteArray readFile(QByteArray blocklist);
+  void ref(QByteArray hash);
+  void unref(QByteArray hash);
+  // Add or drop a reference to each block of blocklist
+  void refAll(QByteArray blocklist);
+  void unrefAll(QByteArray blocklist);
+  // Copy up to COMPACTBATCH live blocks out of the segment that is most
+  // dead, deleting it once none are left; false if there was nothing to do
+  bool compactStep();
+
+private:
+  ChunkStore(const ChunkStore &);
+  ChunkStore &operator=(const ChunkStore &);
+  QString segmentName(int segment);
+  // Open segment for reading and appending, returning its descriptor
+  int openSegment(int segment);
+  // Start a new segment to append to
+  bool roll();
+  // Append data to the active segment as the block stored under hash
+  bool append(QByteArray hash, QByteArray data, int refs);
+  QString prefix;
+  QHash<QByteArray, ChunkLocation> chunks;
+  // Open descriptor of each segment: Hash<segment, fd>
+  QHash<int, int> fds;
+  // Bytes in each segment, and bytes of blocks in it nothing refers to
+  QHash<int, qint64> segmentBytes;
+  QHash<int, qint64> deadBytes;
+  // Blocks in each segment: Hash<segment, block hashes>
+  QHash<int, QSet<QByteArray> > segmentChunks;
+  // Segment being appended to, or -1
+  int active;
+};
+
+// Systematic Reed-Solomon code over GF(2^8): k data fragments plus m
+// parity fragments, any k of which give back the data. Parity rows
+// come from a Cauchy matrix, so any k rows of the code are invertible.
+class ErasureCode {
+public:
+  ErasureCode(int k, int m);
+  // The m parity fragments of k data fragments of equal length
+  QList<QByteArray> encode(QList<QByteArray> data);
+  // The k data fragments, given at least k fragments of equal length
+  // keyed by index (data first, then parity), or empty on failure
+  QList<QByteArray> decode(QMap<int, QByteArray> have);
+
+  int dataCount;
+  int parityCount;
+
+private:
+  // Coefficient of data fragment j in fragment i
+  quint8 coef(int i, int j);
+  // Field arithmetic through the log tables
+  static quint8 mul(quint8 a, quint8 b);
+  static quint8 inv(quint8 a);
+  // dst ^= c * src over len bytes, 16 at a time if the CPU has SSSE3
+  static void mulAdd(quint8 c, const uchar *src, uchar *dst, int len);
+  static void initTables();
+  static quint8 expTable[510];
+  static quint8 logTable[256];
+  static bool tablesReady;
+  // Whether the CPU running this has SSSE3
+  static bool useSsse3;
+};
+
+// Where a block (or blocklist metafile) with a given SHA-1 can be read from
+class BlockLocation {
+public:
+  BlockLocation();
+  BlockLocation(int a, QString f, qint64 b);
+  bool operator==(const BlockLocation l) const;
+  // ArchiveKind of the archive holding the file
+  int archive;
+  // Key of the file in that archive
+  QString filename;
+  // Index of the block in the file, or -1 for the blocklist metafile
+  qint64 blockIndex;
+};
+
+// A node that a download fetches blocks from
+class DownloadSource {
+public:
+  DownloadSource();
+  DownloadSource(QString o, Peer p);
+  QString originID;
+  Peer peer;
+  // Number of requests sent to this source and not yet answered
+  int inFlight;
+  // Max number of requests this source may have in flight
+  int window;
+  // Smoothed round-trip time in ms, or -1 until the first reply
+  qint64 srtt;
+  // Number of consecutive requests to this source that timed out
+  int timeouts;
+  // Whether the source has stopped answering
+  bool failed;
 };
 
 class DownloadFile {
 public:
   DownloadFile();
+  // Index of origin in sources, or -1 if it is not a source
+  int sourceIndex(QString origin);
   QString targetNode;
   Files *file;
   QFile *writeFile;
   qint64 blocksDownloaded;
-  Peer dest;
   QVariantMap *msg;
   bool isDownload;
   bool isRed;
+  // Whether blocks go into the chunk store rather than writeFile
+  bool packed;
+  // Bytes of the file received so far
+  qint64 bytesReceived;
+  // Requests for the same contents under other names, made while this
+  // download ran and started once it ends: List<(request, isDownload)>
+  QList<QPair<QPair<QString, QPair<QByteArray, QString> >, bool> > queued;
+
+  // Nodes holding the file, with targetNode first
+  QVector<DownloadSource> sources;
+  // Blocks requested but not yet received, with the blocklist metafile
+  // as block -1: Map<block index, (ms since start when last requested,
+  // index in sources it was requested from)>
+  QMap<qint64, QPair<qint64, int> > *outstanding;
+  // Blocks whose request timed out, to be requested again
+  QList<qint64> *pending;
+  // Indices of each block in the blocklist: Map<block SHA-1, indices>
+  QHash<QByteArray, QList<qint64> > *blockPositions;
+  // Whether each block has been written to writeFile
+  QVector<bool> received;
+  // Lowest block index not yet requested
+  qint64 nextBlock;
+  // Started when the download is, to time out outstanding requests
+  QElapsedTimer clock;
 
   QTimer *retransmit;
 };
 
-class FileSharing : public QFileDialog {
+class FileSharing : public QObject {
   Q_OBJECT
 public:
   FileSharing();
   QVector<Files> files;
-  Files* getFile(QString fileName);
 signals:
   void shareFiles(FileSharing*);
 public slots:
   void gotFilesSelected(QStringList fileList);
+  void gotFileIngested(FileIngest *ingest);
+private:
+  // Selected files still being hashed
+  int pending;
+};
+
+// Position on the 160-bit identifier ring, as big-endian 32-bit words.
+// Arithmetic wraps modulo 2^160.
+class RingId {
+public:
+  static const int BITS = 160;
+  static const int WORDS = 5;
+
+  RingId();
+  // Position named by a 20-byte SHA-1 digest
+  RingId(QByteArray digest);
+  // 2^bit, or 0 for bit >= BITS
+  static RingId power(int bit);
+  RingId operator+(const RingId &o) const;
+  RingId operator-(const RingId &o) const;
+  bool operator<(const RingId &o) const;
+  bool operator==(const RingId &o) const;
+  bool operator!=(const RingId &o) const;
+  // The 20-byte digest form, as sent in messages
+  QByteArray toByteArray() const;
+  QString toString() const;
+
+  quint32 words[WORDS];
 };
 
 class FingerTableItem {
 public:
   FingerTableItem();
-  int intervalStart;
-  int intervalEnd;
+  RingId intervalStart;
+  RingId intervalEnd;
   QString originID;
+  // Ring position of originID
+  RingId nodeHash;
 };
 
 
@@ -114,22 +458,230 @@ class FingerTable : public QObject {
 public:
   QVector<FingerTableItem*> items;
   FingerTable();
-  FingerTable(int nSpots, QString originID);
+  // Table for node originID, alone in the ring with one vnode
+  FingerTable(QString originID);
   // Debug only to print the finger table 
   void printFingerTable();
+  // Nearest other nodes behind and ahead of this node's first vnode
   QString oneBehind;
-  int curHash;
-  // to get the hash function
-  int getHash(int nSpots, QString originId); 
-  // to add a Node 
-  void addNode(int nSpots, QString originID); 
-  // based on a hash get the corresponding string
-  QString getPeerFromHash(int hash);
-  void updateBehindHash(int nSpots, QString newID);
-  // get the distance from the current to the destination, wrapping ish!
-  int getDistance(int nSpots, int dest, int cur);
+  QString oneAhead;
+  // Ring position of this node's first vnode
+  RingId curHash;
+  // Ring position of oneBehind's vnode just behind curHash
+  RingId behindHash;
+  // to get the hash function, memoized in hashCache
+  RingId getHash(QString originId); 
+  // Ring position of node id's i-th vnode. Vnode 0 sits at getHash(id).
+  RingId vnodeHash(QString id, int i);
+  // Add node originID with the given number of vnodes, or change its
+  // count, and refresh the fingers
+  void addNode(QString originID, int vnodes); 
+  // Drop node originID from the ring and refresh the fingers
+  void removeNode(QString originID);
+  // Node owning key: the one whose vnode is key's successor
+  QString ownerOf(RingId key);
+  // Position of the vnode just before pos, wrapping, or pos itself if
+  // the ring is empty
+  RingId predecessorOf(RingId pos);
+  // Nodes holding redundant copies of key: the first r nodes other than
+  // its owner found walking forward from the owning vnode
+  QStringList replicasOf(RingId key, int r);
+  // Next hop for a message about hash: the finger closest before hash,
+  // or hash's owner once no finger lies between this node and it
+  // Fingers on nodes in avoid are passed over.
+  QString getPeerFromHash(RingId hash, QSet<QString> avoid);
+  // Every vnode in the DHT: Map<position, originID>
+  QMap<RingId, QString> *ring;
+  // Vnodes each node in ring hosts: Hash<originID, count>
+  QHash<QString, int> *vnodeCounts;
 signals:
-  void deleteRedundancies();
+  // Nodes joined or left, so replica sets may have moved
+  void ringChanged();
+private:
+  // Point each finger at the successor of its interval start, and
+  // recompute oneBehind/oneAhead, after a membership change
+  void rebuild();
+
+  // Node this table belongs to
+  QString self;
+  // Ring positions already computed: Hash<ID, position>
+  QHash<QString, RingId> *hashCache;
+};
+
+// An iterative lookup of the owner of a key, run by the node that wants
+// to send messages about it
+class Lookup {
+public:
+  Lookup();
+  RingId key;
+  // Messages to send to the owner once it is found
+  QList<QVariantMap> pending;
+  // Nodes to ask next, closest to key first
+  QStringList candidates;
+  // Nodes already asked
+  QStringList queried;
+  // Nodes asked and not yet answered: Hash<originID, ms sent at>
+  QHash<QString, qint64> inFlight;
+};
+
+// Filenames ordered by last use, most recent first. A hash into a
+// doubly linked list makes touching, removing and finding the least
+// recently used file all O(1).
+class RecencyList {
+public:
+  RecencyList();
+  ~RecencyList();
+  // Make filename the most recently used, adding it if absent
+  void touch(QString filename);
+  // Forget filename, if present
+  void remove(QString filename);
+  bool contains(QString filename) const;
+  // The least recently used filename, or "" if there is none
+  QString last() const;
+  int size() const;
+  bool isEmpty() const;
+  // Filenames, most recently used first
+  QStringList toList() const;
+
+private:
+  struct Entry {
+    QString filename;
+    Entry *prev;
+    Entry *next;
+  };
+  RecencyList(const RecencyList &);
+  RecencyList &operator=(const RecencyList &);
+  // Take e out of the list, leaving it in entries
+  void unlink(Entry *e);
+  // Put an unlinked e at the head of the list
+  void pushFront(Entry *e);
+  QHash<QString, Entry*> entries;
+  // Most and least recently used entries
+  Entry *head;
+  Entry *tail;
+};
+
+// Decides which owned or redundant file the DHT store evicts next, and
+// whether a file arriving at a full store is worth an eviction at all
+class EvictionPolicy {
+public:
+  EvictionPolicy();
+  virtual ~EvictionPolicy();
+  // Policy selected by name with -evict=, or NULL if there is none
+  static EvictionPolicy *create(QString name);
+  virtual QString name() const = 0;
+  // filename has been stored
+  virtual void insert(QString filename) = 0;
+  // filename, which is stored, has been used
+  virtual void touch(QString filename) = 0;
+  // filename has left the store; evicted is true if it was the victim
+  virtual void remove(QString filename, bool evicted) = 0;
+  // The stored file to evict next, or "" if there is none
+  virtual QString victim() const = 0;
+  // Stored files, the next to be evicted last
+  virtual QStringList toList() const = 0;
+  // Whether candidate, not yet stored, is worth evicting victim for
+  virtual bool admit(QString candidate, QString victim);
+  // Count a search the store is responsible for, a hit if it held the file
+  void lookedUp(QString filename, bool hit);
+  // Share of searches counted by lookedUp that were hits
+  double hitRatio() const;
+  qint64 hits;
+  qint64 misses;
+  qint64 evictions;
+  // Files turned away because the store would not make room for them
+  qint64 rejections;
+
+protected:
+  // Note a search for filename that the store could not answer
+  virtual void missed(QString filename);
+};
+
+// Evicts the least recently used file
+class LruPolicy : public EvictionPolicy {
+public:
+  virtual QString name() const;
+  virtual void insert(QString filename);
+  virtual void touch(QString filename);
+  virtual void remove(QString filename, bool evicted);
+  virtual QString victim() const;
+  virtual QStringList toList() const;
+
+private:
+  RecencyList order;
+};
+
+// Evicts the least frequently used file. Each eviction raises the
+// starting count of later files to the victim's count (dynamic aging),
+// so files that were popular long ago do not stay forever.
+class LfuPolicy : public EvictionPolicy {
+public:
+  LfuPolicy();
+  virtual QString name() const;
+  virtual void insert(QString filename);
+  virtual void touch(QString filename);
+  virtual void remove(QString filename, bool evicted);
+  virtual QString victim() const;
+  virtual QStringList toList() const;
+
+private:
+  // Give filename count, ordered after files with the same count
+  void setCount(QString filename, quint32 count);
+  // Hash<filename, rank>, a rank being a count above a tick
+  QHash<QString, quint64> ranks;
+  // Map<rank, filename>, the victim first
+  QMap<quint64, QString> byRank;
+  quint32 tick;
+  // Count of the latest victim
+  quint32 age;
+};
+
+// Two queues: files enter a FIFO and move to an LRU once used again, so
+// files touched by a scan of one-off searches leave before those in use.
+// Recently evicted FIFO files are remembered and go straight to the LRU
+// if stored again.
+class TwoQueuePolicy : public EvictionPolicy {
+public:
+  virtual QString name() const;
+  virtual void insert(QString filename);
+  virtual void touch(QString filename);
+  virtual void remove(QString filename, bool evicted);
+  virtual QString victim() const;
+  virtual QStringList toList() const;
+
+private:
+  // Files used once since being stored
+  RecencyList recent;
+  // Files used again
+  RecencyList frequent;
+  // Files evicted from recent, no longer stored
+  RecencyList ghosts;
+};
+
+// LRU behind a TinyLFU admission filter: a file arriving at a full store
+// only displaces the LRU victim if it has been searched for at least as
+// often. Counts are kept approximately in a count-min sketch that is
+// halved periodically.
+class TinyLfuPolicy : public LruPolicy {
+public:
+  TinyLfuPolicy();
+  virtual QString name() const;
+  virtual void touch(QString filename);
+  virtual bool admit(QString candidate, QString victim);
+
+protected:
+  virtual void missed(QString filename);
+
+private:
+  // Count a use of filename in the sketch
+  void record(QString filename);
+  // Estimated uses of filename
+  int estimate(QString filename) const;
+  // Sketch counter for filename in row
+  int slot(QString filename, int row) const;
+  QVector<quint8> counters;
+  // Uses recorded since the sketch was last halved
+  int samples;
 };
 
 class NetSocket : public QUdpSocket {
@@ -143,15 +695,19 @@ public:
   Peer getThisPeer();
   void incSeqNo();
   bool getNF();
-  bool isDownloading();
-  QByteArray getDfileBlockReq();
-  QString getTargetNode();
+  void setNF(bool nf);
+  // Set the DHT size limit in bytes
+  void setDHTSizeLimit(qint64 bytes);
+  // Apply a node setting given as -name or -name=value, the same from
+  // the dialog's command line as from a daemon's. Returns false, saying
+  // why, if opt is not a setting or its value is not valid.
+  bool applyOption(QString opt);
+  // Whether a download of the file with the given blocklistHash is running
+  bool isDownloading(QByteArray blocklistHash);
 
   // files that i've tried to upload to the DHT. 
   QMap<QString, QPair<QByteArray, QString> > *uploadedFiles;
 
-  QComboBox *originList;
-
   // Bind local peerster to a socket
   bool bind();
   // Archive msg, update status
@@ -170,6 +726,46 @@ public:
   bool isP2P(QVariantMap msg);
   // Returns true if msg has "Origin", "Search", and "Budget" fields
   bool isSearchReq(QVariantMap msg);
+  // Handler for messages of one MsgType
+  typedef void (NetSocket::*MsgHandler)(QVariantMap msg, Peer *senderPeer);
+  // Register handler for messages of the given MsgType
+  void addHandler(int type, MsgHandler handler);
+  // Handler for binary messages of one MsgType, reading their fields in
+  // place rather than from a decoded QVariantMap
+  typedef void (NetSocket::*WireHandler)(WireMessage *wire,
+                                         Peer *senderPeer);
+  // Register handler for binary messages of the given MsgType, taking
+  // them before the QVariantMap handler
+  void addWireHandler(int type, WireHandler handler);
+  // Infer the MsgType of a message that doesn't carry one
+  int classify(QVariantMap msg);
+  // Returns true if the P2P message msg is for this node, otherwise
+  // forwarding it if allowed
+  bool isForMe(QVariantMap msg);
+  // Message handlers, one per MsgType
+  void handleStatus(QVariantMap msg, Peer *senderPeer);
+  void handleRumor(QVariantMap msg, Peer *senderPeer);
+  void handlePrivate(QVariantMap msg, Peer *senderPeer);
+  void handleBlockReq(QVariantMap msg, Peer *senderPeer);
+  void handleBlockReply(QVariantMap msg, Peer *senderPeer);
+  void handleSearch(QVariantMap msg, Peer *senderPeer);
+  void handleSearchReply(QVariantMap msg, Peer *senderPeer);
+  void handleTransfer(QVariantMap msg, Peer *senderPeer);
+  void handleTransferAck(QVariantMap msg, Peer *senderPeer);
+  void handlePing(QVariantMap msg, Peer *senderPeer);
+  void handlePong(QVariantMap msg, Peer *senderPeer);
+  void handleFindSucc(QVariantMap msg, Peer *senderPeer);
+  void handleFindSuccReply(QVariantMap msg, Peer *senderPeer);
+  // In-place handlers for the block traffic that makes up most datagrams
+  void handleWireBlockReq(WireMessage *wire, Peer *senderPeer);
+  void handleWireBlockReply(WireMessage *wire, Peer *senderPeer);
+  // Send senderPeer the block or blocklist metafile blockReq that origin
+  // asked for, if this node has it
+  void serveBlock(QString origin, QByteArray blockReq, Peer *senderPeer);
+  // Hand data, origin's reply for blockReply, to the downloads waiting
+  // on it, adding holders as sources
+  void takeBlock(QString origin, QByteArray blockReply, QByteArray data,
+                 QStringList holders);
   // Send status to peer p
   void sendStatus(Peer *p);
   // Turn off timer and (1) send a message senderPeer needs,
@@ -182,8 +778,19 @@ public:
   // If it doesn't already exist, add a peer with
   // given attributes to peerList
   void learnPeer(QHostAddress sender, quint16 senderPort);
-  // Send message msg to peer p
+  // Send message msg to peer p, binary-encoded if p understands it
   void sendMsg(QVariantMap *msg, Peer p);
+  // Queue datagram for p, to go out with the next batched write
+  void queueDatagram(QByteArray datagram, Peer p);
+  // Append to batch every datagram waiting on the socket, reading
+  // many per system call
+  void receiveBatch(QList<QPair<QByteArray, Peer> > *batch);
+  // Decode and dispatch one datagram received from p
+  void processDatagram(QByteArray datagram, Peer p);
+  // Decode a datagram from p, already parsed into wire if it is in the
+  // binary format (wire is NULL otherwise), noting whether p
+  // understands the binary one
+  QVariantMap decodeMsg(QByteArray datagram, Peer p, WireMessage *wire);
   // Convert arg to a peer and add it to peerList if valid
   void argToPeer(QString arg);
   // Add arguments to routingTable
@@ -200,9 +807,38 @@ public:
   // either the blocklistHash or a 20-byte chunk of the
   // blocklist
   QByteArray findBlock(QByteArray blockReq);
-  // Update file download appropriately, sending next request, restarting
-  // timer, and deleting file download as necessary
-  void processBlockReply(QByteArray data);
+  // Return the nodes known to hold the file with the given
+  // blocklistHash: this node, plus the owner and its replicas
+  QStringList holdersOf(QByteArray blocklistHash);
+  // Return the running downloads waiting on blockReq (a block or a
+  // blocklist metafile) from origin
+  QList<DownloadFile*> findDownloads(QByteArray blockReq, QString origin);
+  // Also fetch d's blocks from origin, if it is a reachable node
+  void addDownloadSource(DownloadFile *d, QString origin);
+  // Update file download d appropriately, crediting origin for the reply,
+  // writing data at the offset(s) of blockReq, refilling the request
+  // windows, and finishing the file download as necessary
+  void processBlockReply(DownloadFile *d, QString origin,
+                         QByteArray blockReq, QByteArray data);
+  // Return the index of the source in d that should get the next request,
+  // favouring sources expected to answer soonest, or -1 if all are busy
+  int pickSource(DownloadFile *d);
+  // Stop d's timer and forget about it, starting the downloads queued
+  // behind it
+  void endDownload(DownloadFile *d);
+  // Local file a download of filename is written to: download_ for the
+  // user, or dht_, red_ or hot_ after the archive it is fetched for
+  QString downloadName(QString filename, bool isDownload);
+  // Archive a copy of name fetched for the store goes into: the DHT
+  // archive before the redundancy archive before the hot one, or
+  // FILE_ARCHIVE if it is in none of them
+  int storeKind(QString name);
+  // Send block requests for d until every source has a full window
+  // in flight
+  void fillWindow(DownloadFile *d);
+  // Send (or resend) the request for the given block of d to d's source
+  // src, where block -1 is the blocklist metafile
+  void sendBlockReq(DownloadFile *d, qint64 block, int src);
   // Search for search request string among file names in
   // fileArchive; send search reply if found
   void processSearchReq(QVariantMap msg, Peer p);
@@ -218,9 +854,37 @@ public:
   // Update dhtStatus to reflect new (higher) seqno and join state
   void updateDhtStatus(QVariantMap *msg);
   // Add to finger table
-  void addToFingerTable(QString origin);
-  // Send redunant copies to appropriate node for all files in toCopy
+  void addToFingerTable(QString origin, int vnodes);
+  // Host n vnodes when joining the DHT, instead of one per VNODEBYTES of
+  // size limit
+  void setVnodes(int n);
+  // Vnodes this node hosts when it joins the DHT
+  int myVnodes();
+  // Keep n redundant copies of each owned file
+  void setReplicas(int n);
+  // Send redunant copies to appropriate nodes for all files in toCopy
   void sendRedundancies(FileSharing *toCopy);
+  // Send file to those of its replica holders not yet sent a copy
+  void sendReplicas(Files file);
+  // Same, always as whole copies, even of a file that would be coded
+  void sendWholeCopies(Files file);
+  // Erasure code owned files into k data and m parity fragments, spread
+  // over the next k + m successors instead of whole replicas
+  void setErasure(int k, int m);
+  // Whether file is sent out as fragments rather than whole copies
+  bool isErasureCoded(Files file);
+  // Send each fragment of file to its holder, assigning holders to
+  // fragments that have none
+  void sendFragments(Files file);
+  // Compute file's fragments, archiving them in fragmentArchive
+  void encodeFile(Files file);
+  // Forget filename's fragments and delete its parity files
+  void dropFragments(QString filename);
+  // Fetch the fragments of filename, which this node has come to own,
+  // from their holders, then decode it
+  void rebuildFile(QString filename);
+  // Decode filename once enough of its fragments are in
+  void finishRebuild(QString filename);
   // is TransferRequest
   bool isTransferRequest(QVariantMap msg);
   // foundTransferRequest
@@ -230,12 +894,10 @@ public:
   // send it to corresponding node in fingerTable
   void sendThroughFingerTable(QVariantMap *msg);
   // Whether this node is in charge of the desiredLoc location in the DHT
-  bool isMyDHTRequest(int desiredLoc);
+  bool isMyDHTRequest(RingId desiredLoc);
   // Whether or not this node has the file with the given filename in
   // its redundancy archive
   bool haveRedundantCopy(QString filename);
-  // Delete filename from recentDHTFiles
-  void removeFromRecentDHTFiles(QString filename);
   // Print out DHT archive
   void printDHTArchive();
   // Print out redundancy archive
@@ -245,22 +907,185 @@ public:
   QMap<QString, Files> *dhtArchive;
   // Archive of files owned as redundant copies by this peer: Map<filename, file>
   QMap<QString, Files> *redundancyArchive;
+  // Fragments of owned files: Map<filename.frag<i>, fragment>
+  QMap<QString, Files> *fragmentArchive;
+  // Copies of files this node relays many searches for, kept apart from
+  // the DHT store: Map<filename, file>, empty while being fetched
+  QMap<QString, Files> *hotArchive;
+  // Ring position of each file in dhtArchive: MultiMap<key, filename>
+  QMultiMap<RingId, QString> *ownedKeys;
+  // Files handed to a new owner that has yet to fetch them:
+  // Hash<filename, owner>
+  QHash<QString, QString> *handoffs;
+  // Whether this node is waiting on handoffs to leave the DHT, how many
+  // times it has offered them, and the timer for offering them again
+  bool leaving;
+  int leaveTries;
+  QTimer *leaveTimer;
+  // Timer for probing ring neighbours and fingers
+  QTimer *stabilizeTimer;
+  // Clock that probe times are read from
+  QElapsedTimer liveClock;
+  // When each watched node was first probed without reply since its
+  // last answer: Hash<originID, ms on liveClock>
+  QHash<QString, qint64> *pingSent;
+  // Nodes routed around for not answering
+  QSet<QString> *suspected;
+  // Nodes dropped from the ring for not answering, still probed
+  QSet<QString> *presumedDead;
+  // Owners learned from search replies and transfer acknowledgements:
+  // Hash<ring key, <originID, expiry in ms on liveClock> >, cleared
+  // whenever the ring changes
+  QHash<QByteArray, QPair<QString, qint64> > *ownerCache;
+  // Whether key owners are found by iterative lookups
+  bool iterative;
+  // Iterative lookups under way: Hash<ring key, lookup>
+  QHash<QByteArray, Lookup*> *lookups;
+  // Timer for moving lookups past hops that timed out
+  QTimer *lookupTimer;
+  // Searches relayed for each filename in the current HOTWINDOW
+  QHash<QString, int> *relayCounts;
+  // Start of the current HOTWINDOW on liveClock
+  qint64 relayWindowStart;
+  // Hot files whose blocklist hash we have searched for: Hash<filename,
+  // ms on liveClock the search was sent at>, given up after HOTWINDOW
+  QHash<QString, qint64> *hotPending;
+  // Fetched hot copies by last use
+  RecencyList *hotOrder;
+  // Bytes on disk in each archive: Hash<ArchiveKind, bytes>
+  QHash<int, qint64> *archiveBytes;
+  // Log of the archives' contents, NULL while they are being restored
+  StoreIndex *storeIndex;
+  // Blocks of the copies kept for the DHT and the hot-file cache
+  ChunkStore *chunkStore;
+  // Timer for compacting the chunk store a batch at a time
+  QTimer *compactTimer;
+  // Space set aside for downloads under way:
+  // Hash<blocklist hash, <ArchiveKind, bytes> >
+  QHash<QByteArray, QPair<int, qint64> > *reservations;
+  // Insert file under key in the given archive, replacing and
+  // reindexing any previous entry
+  void archiveFile(int archive, QString key, Files file);
+  // Remove key from the given archive and drop its blocks from blockIndex
+  void unarchiveFile(int archive, QString key);
+  // Return the archive map for the given ArchiveKind
+  QMap<QString, Files>* getArchive(int archive);
   QString removePrefix(QString withPrefix);
   void copyFile(QVariantMap msg);
-  void transferToAddedNode();
-  void deleteDHTFilesFromNode(FileSharing *toDelete);
+  // Hash the file at path off the event loop, handing the result to
+  // gotFileIngested along with purpose and context
+  void ingestFile(QString path, int purpose, QVariantMap context);
+  // Store an ingested file as owned/redundant, the latter given the
+  // transfer request that brought it
+  void storeOwnedCopy(Files file);
+  void storeRedundantCopy(QVariantMap msg, Files file);
+  // Download the fragment offered by transfer request msg
+  void storeFragmentCopy(QVariantMap msg);
+  // Whether the fragment set described by msg can be rebuilt from: a
+  // k-of-n code with a hash and holder per fragment, for a file no
+  // bigger than this node would store
+  bool isValidFragmentSet(QVariantMap msg);
+  // Archive a hashed parity fragment; context names its file and index
+  void storeFragment(QVariantMap context, Files file);
+  // Hand the files whose keys origin's vnodes have taken over to it
+  void transferToAddedNode(QString origin);
+  // Names of owned files with keys in (low, high], wrapping past zero
+  QStringList ownedIn(RingId low, RingId high);
+  // Send owned filename to owner, serving it as a redundant copy until
+  // owner acknowledges it
+  void handOff(QString filename, QString owner);
+  // Send owner a transfer request for filename; false if unreachable
+  bool offerFile(QString filename, QString owner, QByteArray blocklistHash);
+  // Stop waiting on handoffs, drop the copies left with no owner to
+  // give them to, and report having left the DHT
+  void finishLeave();
+  // Node to send a message about hash to: the next hop past suspected
+  // nodes, with a suspected owner's stand-in in place of the owner
+  QString routeTarget(RingId hash);
+  // First live successor of key's owner if the owner is suspected of
+  // having failed, standing in for it; "" otherwise
+  QString standInFor(RingId key);
+  // Keep the file offered by transfer request msg as a redundant copy
+  // while owner does not answer, to be handed over to it later
+  void holdFor(QVariantMap msg, QString owner);
+  // Drop a node that stopped answering probes from the ring
+  void declareDead(QString node);
+  // Send a MSG_PING or MSG_PONG to dest
+  void sendProbe(int type, QString dest);
+  // Owner of key learned from a recent reply, or "" if none is trusted
+  QString cachedOwner(RingId key);
+  // Remember owner as the node answering for key
+  void cacheOwner(RingId key, QString owner);
+  // Send msg to node dest, if there is a route to it
+  void sendToNode(QVariantMap *msg, QString dest);
+  // Find key owners by asking nodes iteratively, rather than passing
+  // messages through the finger table
+  void setIterative(bool on);
+  // Send msg to key's owner once an iterative lookup has found it
+  void startLookup(RingId key, QVariantMap msg);
+  // Ask lookup's next candidates until LOOKUPALPHA queries are in flight
+  void advanceLookup(Lookup *lookup);
+  // Send lookup's messages to owner, or through the finger table if
+  // owner is "", and forget it
+  void finishLookup(Lookup *lookup, QString owner);
+  // Tell dest that filename, which it offered, has been fetched
+  void sendTransferAck(QString dest, QString filename);
+  // Move filename's copy into archive to (owned or redundant), renaming
+  // it on disk to match
+  void moveCopy(QString filename, int to);
+  // Count a search relayed for filename, fetching a copy of it once
+  // HOTRELAYS searches have been relayed within HOTWINDOW
+  void noteRelay(QString filename);
+  // Start fetching the hot file named in a reply to our own search
+  void fetchHotCopy(QVariantMap msg);
+  // Whether or not this node holds a cached copy of filename
+  bool haveHotCopy(QString filename);
+  // Mark filename as the most recently used hot copy
+  void touchHotCopy(QString filename);
+  // Delete the hot copy of filename
+  void dropHotCopy(QString filename);
+  // Rebuild the archives from the records of index, keeping only files
+  // still on disk as indexed, then keep the index from here on
+  void loadStore(StoreIndex *index, QList<StoreRecord> records);
+  // Whether the entry for key in archive belongs in the store index
+  bool isIndexed(int archive, QString key, Files file);
+  // Append a record to the store index, compacting it when it has grown
+  // well past the archives it describes
+  void logStore(int op, int archive, QString key, Files file);
+  // Rewrite the store index from the archives as they are
+  void compactStore();
+  // Append this node's originID and the sequence numbers it has reached
+  // to the store index, so that after a restart it numbers its messages
+  // on from where peers last saw them
+  void logOrigin();
 
   //DHT size Limit  
-  void addToFrontRecentDHT(QString filename); 
   void printRecentDHTFiles(); 
-  QVector<QString> *recentDHTFiles; 
-  int dhtSizeLimit; 
-  int dhtCurrentSize; 
-  void removeLastDHTFile(); 
+  // Log the eviction policy's hit ratio and counts
+  void printEvictionStats();
+  // Use the eviction policy selected by name, keeping the files stored
+  bool setEvictionPolicy(QString name);
+  // Orders owned and redundant files for eviction
+  EvictionPolicy *evictionPolicy;
+  // Bytes this node gives the DHT store
+  qint64 dhtSizeLimit; 
+  // Bytes held by the DHT store, or by the hot-file cache if archive is
+  // HOT_ARCHIVE, counting space reserved for downloads into it
+  qint64 usedBytes(int archive);
+  // Set bytes aside for a download of filename into the given archive
+  // of the DHT store or the hot-file cache, evicting files to make room;
+  // false if there is no room to be made. Only redundant copies are put
+  // to the policy's admission test.
+  bool reserveSpace(QString filename, qint64 bytes, int archive,
+                    QByteArray blocklistHash);
+  // Remove filename, the policy's victim, from the store
+  void evictDHTFile(QString filename); 
+  // Delete this node's DHT or redundant copy of filename, giving back
+  // its space, and stop any download of it for the store
+  void dropCopy(QString filename);
   // for search requests 
-  void sendThroughFingerTable(QVariantMap *msg, int hash); 
+  void sendThroughFingerTable(QVariantMap *msg, RingId hash); 
   FingerTable *fingerTable;
-  quint32 nSpots;
 
 private:
   quint16 myPortMin, myPortMax, thisPort;
@@ -273,6 +1098,27 @@ private:
   QVariantMap *status;
   // List of originIDs with lowest sequence number not seen (Map so that searchable)
   QMap<QString, QPair<quint32, bool> > *dhtStatus;
+  // Vnodes announced by each node in its latest join: Hash<originID, count>
+  QHash<QString, int> *dhtVnodes;
+  // Vnode count set with setVnodes, 0 to derive it from dhtSizeLimit
+  int vnodeOverride;
+  // Redundant copies kept of each owned file
+  int replicas;
+  // Nodes already sent a copy of each owned file: Hash<filename, nodes>,
+  // indexed by fragment for erasure coded files
+  QHash<QString, QStringList> *replicaHolders;
+  // Data and parity fragments per erasure coded file, 0 to replicate
+  int ecData;
+  int ecParity;
+  // Owned files whose parity is being hashed
+  QSet<QString> *encoding;
+  // Transfer request for each fragment held: Hash<filename, request>
+  QHash<QString, QVariantMap> *fragmentSets;
+  // Fragment files in hand per file being rebuilt:
+  // Hash<filename, Map<index, path> >
+  QHash<QString, QMap<int, QString> > *rebuilds;
+  // Fragments being fetched: Hash<blocklistHash, <filename, index> >
+  QHash<QByteArray, QPair<QString, int> > *fragmentDownloads;
   // Archive of all messages: Map<originID, Map<seqNo, msg> >
   QMap<QString, QMap<quint32, QVariant> > *archive;
   // List of all peers (excluding self)
@@ -285,16 +1131,33 @@ private:
   QTimer *entropyTimer;
   // Hop list
   QHash<QString, Peer*> *routingTable;
+  // Message handlers: Hash<MsgType, handler>
+  QHash<int, MsgHandler> *handlers;
+  // Binary message handlers: Hash<MsgType, handler>
+  QHash<int, WireHandler> *wireHandlers;
+  // Datagrams waiting for the next batched write: List<datagram, peer>
+  QList<QPair<QByteArray, Peer> > *sendQueue;
+  // Whether a flush of sendQueue is already scheduled
+  bool flushScheduled;
+  // Receive slots for batched reads, MAXDATAGRAM bytes each
+  QByteArray *recvBuffer;
+  // Peers known to understand the binary wire format: Set<host:port>
+  QSet<QString> *binaryPeers;
   // Route rumor timer
   QTimer *routeTimer;
   // Flag for whether noforward command link option is specified
   bool noForward;
   // Archive of Files downloaded by this peer: Map<filename, file>
   QMap<QString, Files> *fileArchive;
-  // Whether there is a file being downloaded
-  bool downloading;
-  // Information on the file being downloaded
-  DownloadFile *dfile;
+  // Index of every block and blocklist metafile held in dhtArchive,
+  // redundancyArchive and fileArchive: Map<SHA-1, locations>, with
+  // each list ordered by ArchiveKind
+  QHash<QByteArray, QList<BlockLocation> > *blockIndex;
+  // Add/remove the blocks of file, stored under key, to/from blockIndex
+  void indexFile(int archive, QString key, Files file);
+  void unindexFile(int archive, QString key, Files file);
+  // Files being downloaded: Map<blocklistHash, download>
+  QHash<QByteArray, DownloadFile*> *downloads;
   // Whether the user wants to join the DHT
   bool joinDHT;
   // Whether the user has joined the DHT
@@ -303,22 +1166,37 @@ private:
 signals:
   void joinedDHT();
   void leftDHT();
+  // Chat message or PM text to display
+  void chatText(QString sender, QString text);
+  // Search reply addressed to this node
+  void searchReply(QVariantMap msg);
+  // Origin added to the routing table for the first time
+  void newOrigin(QString origin);
 
 public slots:
+  // Read and dispatch incoming datagrams
+  void readMsg();
+  // Write out every queued datagram, many per system call
+  void flushSends();
   void gotTimeout();
   void gotEntropyTimeout();
   void gotRouteTimeout();
   void lookedUp(QHostInfo hostInfo);
-  void resetOL();
   void gotSendPM(QVariantMap msg);
   void gotShareFiles(FileSharing *share);
   void gotReqToDownload(QPair<QString, QPair<QByteArray, QString> > pair, bool isDownload);
   void gotRetransmit();
   void gotStartSearchFor(QPair<QString, quint32> pair);
   void gotChangedDHTPreference(int state);
-  void gotDeleteRedundancies();
+  void gotLeaveTimeout();
+  void gotStabilizeTimeout();
+  void gotLookupTimeout();
+  void gotCompactTimeout();
+  void gotRingChanged();
+  void gotFileIngested(FileIngest *ingest);
 };
 
+#ifndef PEERSTER_DAEMON
 class ChatDialog : public QDialog {
   Q_OBJECT
 
@@ -329,8 +1207,6 @@ public slots:
   void gotReturnPressed();
   void gotPortInput();
   void displayText(QString sender, QString text);
-  void readMsg();
-  void processMsgOrRouteOrDHT(QVariantMap msg, Peer *senderPeer);
   void newPrivateMsg(QString origin);
   void shareFile();
   void gotDownloadReq();
@@ -339,6 +1215,9 @@ public slots:
   void gotJoinedDHT();
   void gotLeaveDHT();
   void gotLeftDHT();
+  void gotJoinDHTToggled(int state);
+  void gotNewOrigin(QString origin);
+  void resetOL();
 
   // Process search reply, adding information to
   // searchReplyArchive and displaying for user
@@ -361,6 +1240,7 @@ private:
   QLineEdit *targetNode, *hexBlock, *searchField, *sizeLimit;
   QListWidget *searchResults;
   QCheckBox *joinDHTBox;
+  QComboBox *originList;
   QHBoxLayout *dht;
   // int dhtSizeLimit; 
   // Search request currently awaiting replies
@@ -371,5 +1251,37 @@ private:
   // Timer to resend search request
   QTimer *searchTimer;
 };
+#endif
+
+// Runs a node with no widgets, taking its settings from the command
+// line and config files instead of the dialog
+class Daemon : public QObject {
+  Q_OBJECT
+
+public:
+  Daemon();
+  // Apply a -name or -name=value option, the node's own settings among
+  // them, returning false if unknown or invalid
+  bool applyOption(QString opt);
+  // Apply the options in a file, one per line. Lines not starting
+  // with '-' name peers; lines starting with '#' are comments.
+  void readConfig(QString path);
+
+public slots:
+  void gotChatText(QString sender, QString text);
+  void gotJoinedDHT();
+  void gotLeftDHT();
+
+private:
+  // Share the files listed with -share
+  void shareFiles();
+
+  NetSocket *sock;
+  // Whether to join the DHT at startup
+  bool join;
+  // Files to share, once joined if joining the DHT
+  QStringList toShare;
+  bool shared;
+};
 
 #endif // PEERSTER_MAIN_HH
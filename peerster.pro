@@ -12,3 +12,10 @@ QT += network
 HEADERS += main.hh
 SOURCES += main.cc
 CONFIG += crypto
+
+# Headless node for machines without a display or QtGui: qmake CONFIG+=daemon
+daemon {
+  QT -= gui
+  DEFINES += PEERSTER_DAEMON
+  TARGET = peersterd
+}